@@ -4,8 +4,18 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <threads.h>
 #include "GLFW/glfw3.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/mman.h>
+#endif
+
 void print_memory(char* ptr, size_t bytes) {
     printf("Pointer value: %lld\n", (long long)ptr);
     const int cols = 40;
@@ -35,6 +45,146 @@ const char* g2v_get_error_log() {
     return g2v_error_log;
 }
 
+//Every heap allocation of gl2vid goes through these, so allocations in the steady state can be counted
+atomic_ullong g2v_alloc_counter;
+
+void* g2v_malloc(size_t size) {
+    atomic_fetch_add_explicit(&g2v_alloc_counter, 1, memory_order_relaxed);
+    return malloc(size);
+}
+
+void* g2v_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&g2v_alloc_counter, 1, memory_order_relaxed);
+    return calloc(count, size);
+}
+
+void g2v_free(void* ptr) {
+    free(ptr);
+}
+
+unsigned long long g2v_get_alloc_count() {
+    return atomic_load_explicit(&g2v_alloc_counter, memory_order_relaxed);
+}
+
+/*
+    Large buffers (frames, queues, packet pools) go through a replaceable allocator instead
+*/
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+enum { BUFFER_HEAP, BUFFER_MMAP, BUFFER_LARGE_PAGES };
+
+//Stored right before the returned pointer
+typedef struct {
+    void* base;
+    size_t mapped;
+    int kind;
+} buffer_header;
+
+_Static_assert(sizeof(buffer_header) <= G2V_BUFFER_ALIGNMENT, "buffer_header must fit in the alignment padding");
+
+void* finish_buffer(void* base, size_t mapped, int kind) {
+    uintptr_t data = ((uintptr_t)base + sizeof(buffer_header) + G2V_BUFFER_ALIGNMENT - 1) & ~(uintptr_t)(G2V_BUFFER_ALIGNMENT - 1);
+    buffer_header* header = (buffer_header*)data - 1;
+    header->base = base;
+    header->mapped = mapped;
+    header->kind = kind;
+    return (void*)data;
+}
+
+void* g2v_default_alloc(size_t size, void* userptr) {
+    (void)userptr;
+    size_t total = size + sizeof(buffer_header) + G2V_BUFFER_ALIGNMENT - 1;
+#ifdef _WIN32
+    //Large pages need the SeLockMemoryPrivilege, without it VirtualAlloc fails and the heap is used
+    size_t large_page = GetLargePageMinimum();
+    if(large_page && total >= large_page) {
+        size_t mapped = (total + large_page - 1) & ~(large_page - 1);
+        void* base = VirtualAlloc(NULL, mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if(base) {
+            return finish_buffer(base, mapped, BUFFER_LARGE_PAGES);
+        }
+    }
+#elif defined(MAP_ANONYMOUS)
+    if(total >= HUGE_PAGE_SIZE) {
+        size_t mapped = (total + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        //Explicit huge pages only exist if reserved beforehand (vm.nr_hugepages)
+        void* base = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base != MAP_FAILED) {
+            return finish_buffer(base, mapped, BUFFER_LARGE_PAGES);
+        }
+#endif
+        //Otherwise ask for transparent huge pages, which need a 2MB aligned range: map one more page and trim it
+        char* raw = mmap(NULL, mapped + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw != MAP_FAILED) {
+            char* aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if(aligned > raw) {
+                munmap(raw, aligned - raw);
+            }
+            munmap(aligned + mapped, raw + HUGE_PAGE_SIZE - aligned);
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, mapped, MADV_HUGEPAGE);
+#endif
+            return finish_buffer(aligned, mapped, BUFFER_MMAP);
+        }
+    }
+#endif
+    void* base = malloc(total);
+    return base ? finish_buffer(base, total, BUFFER_HEAP) : NULL;
+}
+
+void g2v_default_free(void* ptr, size_t size, void* userptr) {
+    (void)size;
+    (void)userptr;
+    if(!ptr) {
+        return;
+    }
+    buffer_header* header = (buffer_header*)ptr - 1;
+    switch(header->kind) {
+#ifdef _WIN32
+    case BUFFER_LARGE_PAGES:
+        VirtualFree(header->base, 0, MEM_RELEASE);
+        break;
+#elif defined(MAP_ANONYMOUS)
+    case BUFFER_LARGE_PAGES:
+    case BUFFER_MMAP:
+        munmap(header->base, header->mapped);
+        break;
+#endif
+    default:
+        free(header->base);
+        break;
+    }
+}
+
+g2v_allocator g2v_buffer_allocator = { g2v_default_alloc, g2v_default_free, NULL };
+
+void g2v_get_default_allocator(g2v_allocator* allocator) {
+    allocator->alloc = g2v_default_alloc;
+    allocator->free = g2v_default_free;
+    allocator->userptr = NULL;
+}
+
+void g2v_set_allocator(const g2v_allocator* allocator) {
+    if(allocator) {
+        g2v_buffer_allocator = *allocator;
+    } else {
+        g2v_get_default_allocator(&g2v_buffer_allocator);
+    }
+}
+
+void* g2v_alloc_buffer(size_t size) {
+    atomic_fetch_add_explicit(&g2v_alloc_counter, 1, memory_order_relaxed);
+    return g2v_buffer_allocator.alloc(size, g2v_buffer_allocator.userptr);
+}
+
+void g2v_free_buffer(void* ptr, size_t size) {
+    if(ptr) {
+        g2v_buffer_allocator.free(ptr, size, g2v_buffer_allocator.userptr);
+    }
+}
+
 const char* get_glfw_error() {
     char* err;
     glfwGetError(&err);
@@ -70,348 +220,4114 @@ void g2v_free_context() {
     glfwTerminate();
 }
 
-int g2v_init_render_ctx(g2v_render_ctx* ctx, int width, int height) {
-    ctx->width = width;
-    ctx->height = height;
-    ctx->pix_data = malloc(sizeof(int) * width * height);
-    ctx->current_frame_index = 0;
-
-    glGenFramebuffers(G2V_TARGETS, ctx->framebuffers);
-    glGenBuffers(G2V_TARGETS, ctx->pbos);
-#ifdef G2V_TARGET_RENDERBUFFER
-    glGenRenderbuffers(G2V_TARGETS, ctx->renderbuffers);
+//Monotonic clock for stage timings, which (unlike glfwGetTime()) also works without a g2v_context
+double stage_clock() {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / frequency.QuadPart;
 #else
-    glGenTextures(G2V_TARGETS, ctx->textures);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 #endif
+}
 
-    for(int i = 0; i < G2V_TARGETS; i++) {
-        glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffers[i]);
-#ifdef G2V_TARGET_RENDERBUFFER
-        glBindRenderbuffer(GL_RENDERBUFFER, ctx->renderbuffers[i]);
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA4, width, height);
-        glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, ctx->renderbuffers[i]);
-#else
-        glBindTexture(GL_TEXTURE_2D, ctx->textures[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->textures[i], 0);
-#endif
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[i]);
-        glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+typedef struct {
+    double samples[G2V_STATS_WINDOW];
+    int count;
+    double total;
+} stage_samples;
 
-        assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
-    }
-    return G2V_TRUE;
-}
+struct g2v_timings {
+    //Encoders fed by worker threads (e.g. the sinks of a tee) record their stages concurrently
+    mtx_t lock;
+    stage_samples stages[G2V_STAGE_COUNT];
+    double render_start;
+    int flat_frames;
+    int duplicate_frames;
+    int partial_frames;
+    unsigned long long readback_bytes;
+};
 
-void g2v_free_render_ctx(g2v_render_ctx* ctx) {
-    free(ctx->pix_data);
-    glDeleteFramebuffers(G2V_TARGETS, ctx->framebuffers);
-    glDeleteBuffers(G2V_TARGETS, ctx->pbos);
-#ifdef G2V_TARGET_RENDERBUFFER
-    glDeleteRenderbuffers(G2V_TARGETS, ctx->renderbuffers);
-#else
-    glDeleteTextures(G2V_TARGETS, ctx->textures);
-#endif
+g2v_timings* alloc_timings() {
+    g2v_timings* timings = g2v_calloc(1, sizeof *timings);
+    if(timings && mtx_init(&timings->lock, mtx_plain) != thrd_success) {
+        g2v_free(timings);
+        return NULL;
+    }
+    return timings;
 }
 
-void prepare_gl_state(g2v_render_ctx* ctx) {
-    glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffers[ctx->current_frame_index % G2V_TARGETS]);
-    glViewport(0, 0, ctx->width, ctx->height);
+void free_timings(g2v_timings* timings) {
+    if(timings) {
+        mtx_destroy(&timings->lock);
+        g2v_free(timings);
+    }
 }
 
-void read_gl_data(g2v_render_ctx* ctx) {
-    int read_pbo_idx = ctx->current_frame_index % G2V_TARGETS;
-    int proc_pbo_idx = (read_pbo_idx + 1) % G2V_TARGETS;
-
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[read_pbo_idx]);
-    // glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-    // int* buffer_content = malloc(ctx->width * ctx->height * sizeof(int));
-    glReadPixels(0, 0, ctx->width, ctx->height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
-
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[proc_pbo_idx]);
-    int* buffer_content = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-
-    //Since glReadPixels returns pixel values upside down, we have to preprocess them
-    // memcpy(ctx->pix_data, buffer_content, ctx->width * ctx->height * sizeof(int));
-    int* pix_data = ctx->pix_data + ctx->width * (ctx->height - 1);
-    do {
-        memcpy(pix_data, buffer_content, ctx->width * sizeof(int));
-        pix_data -= ctx->width;
-        buffer_content += ctx->width;
-    } while(pix_data != ctx->pix_data);
-
-    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-
-    ctx->current_frame_index++;
+void record_stage(g2v_timings* timings, g2v_stage stage, double seconds) {
+    stage_samples* s = &timings->stages[stage];
+    mtx_lock(&timings->lock);
+    s->samples[s->count % G2V_STATS_WINDOW] = seconds;
+    s->count++;
+    s->total += seconds;
+    mtx_unlock(&timings->lock);
 }
 
-int g2v_encode(g2v_encoder* encoder, g2v_render_ctx* ctx) {
-    return encoder->encode_fn(ctx, encoder);
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
 }
 
-int glfw_encode(g2v_render_ctx* ctx, g2v_encoder* encoder) {
-    while(!glfwWindowShouldClose(g2v.window)) {
-        glfwPollEvents();
+void g2v_get_stats(const g2v_render_ctx* ctx, g2v_stats* stats) {
+    double sorted[G2V_STATS_WINDOW];
+    mtx_lock(&ctx->timings->lock);
+    for(int i = 0; i < G2V_STAGE_COUNT; i++) {
+        const stage_samples* s = &ctx->timings->stages[i];
+        g2v_stage_stats* out = &stats->stages[i];
+        int n = s->count < G2V_STATS_WINDOW ? s->count : G2V_STATS_WINDOW;
 
-        prepare_gl_state(ctx);
-        int eof = encoder->render_video_frame(ctx, encoder->user_ptr);
-        read_gl_data(ctx);
-        glfwSwapBuffers(g2v.window);
-        if(eof) {
-            break;
+        memset(out, 0, sizeof *out);
+        out->count = s->count;
+        out->total = s->total;
+        if(n == 0) {
+            continue;
         }
+        memcpy(sorted, s->samples, n * sizeof(double));
+        qsort(sorted, n, sizeof(double), compare_doubles);
+        out->p50 = sorted[(n - 1) * 50 / 100];
+        out->p95 = sorted[(n - 1) * 95 / 100];
+        out->p99 = sorted[(n - 1) * 99 / 100];
+        out->max = sorted[n - 1];
     }
-    return G2V_TRUE;
+    mtx_unlock(&ctx->timings->lock);
+    stats->flat_frames = ctx->timings->flat_frames;
+    stats->duplicate_frames = ctx->timings->duplicate_frames;
+    stats->partial_frames = ctx->timings->partial_frames;
+    stats->readback_bytes = ctx->timings->readback_bytes;
 }
 
-int g2v_create_glfw_encoder(g2v_encoder* enc, g2v_render_ctx* ctx) {
-    glfwShowWindow(g2v.window);
-    enc->encode_fn = glfw_encode;
-    return G2V_TRUE;
+void g2v_reset_stats(g2v_render_ctx* ctx) {
+    mtx_lock(&ctx->timings->lock);
+    memset(ctx->timings->stages, 0, sizeof ctx->timings->stages);
+    mtx_unlock(&ctx->timings->lock);
+    ctx->timings->flat_frames = 0;
+    ctx->timings->duplicate_frames = 0;
+    ctx->timings->partial_frames = 0;
+    ctx->timings->readback_bytes = 0;
 }
 
-int g2v_finish_glfw_encoder(g2v_encoder* enc) {
-    glfwHideWindow(g2v.window);
-    return G2V_TRUE;
+const char* g2v_stage_name(g2v_stage stage) {
+    static const char* names[G2V_STAGE_COUNT] = { "render", "map_wait", "flip", "convert", "encode", "mux", "gpu_render", "gpu_readback" };
+    return stage >= 0 && stage < G2V_STAGE_COUNT ? names[stage] : "unknown";
 }
 
-#ifdef G2V_USE_FFMPEG_ENCODER
-
-#include "libavcodec/avcodec.h"
-#include "libavformat/avformat.h"
-#include "libavutil/imgutils.h"
-#include "libavutil/opt.h"
-#include "libswscale/swscale.h"
+/*
+    Tracing: every thread records its events into its own ring buffer (single producer, so no locks are needed),
+    and the rings are only read by g2v_finish_trace(), once the pipeline is idle.
+*/
 
-typedef struct {
-    AVStream* stream;
-    AVCodec* codec;
-    AVCodecContext* codec_ctx;
-    AVFrame* frame;
-    int64_t next_pts;
-    int encoding;
-} ffmpeg_output_stream;
+#define TRACE_RING_SIZE (1 << 16)
 
 typedef struct {
-    ffmpeg_output_stream video, audio;
-    AVFormatContext* output_ctx;
-    struct SwsContext *sws_ctx;
-} ffmpeg_internals;
+    const char* name;
+    char phase;                 //'X' (complete event, begin + end) or 'C' (counter)
+    double begin, end, value;   //seconds on stage_clock(), value for counters
+} trace_event;
 
-#define G2V_EOF 2
+typedef struct trace_ring {
+    trace_event events[TRACE_RING_SIZE];
+    atomic_uint head;
+    int tid;
+    const char* thread_name;
+    struct trace_ring* next;
+} trace_ring;
 
-int ffmpeg_write_frame(ffmpeg_internals* fi, ffmpeg_output_stream* stream) {
-    int ret = avcodec_send_frame(stream->codec_ctx, stream->frame);
-    if(ret < 0) {
-        err_printf("Error sending frame");
-        return G2V_FALSE;
-    }
+struct {
+    atomic_int enabled;
+    atomic_uint generation;
+    _Atomic(trace_ring*) rings;
+    atomic_int next_tid;
+    char* output_file;
+    double origin;
+    //GPU timestamp (in seconds) minus stage_clock(), 0 if not measured yet
+    double gpu_offset;
+} tracer;
 
-    while(ret >= 0) {
-        AVPacket pkt = { NULL };
+_Thread_local trace_ring* thread_ring;
+_Thread_local unsigned thread_ring_generation;
 
-        ret = avcodec_receive_packet(stream->codec_ctx, &pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
-        else if (ret < 0) {
-            err_printf("Error encoding frame");
-            return G2V_FALSE;
-        }
+#define TRACE_GPU_TID 0
 
-        av_packet_rescale_ts(&pkt, stream->codec_ctx->time_base, stream->stream->time_base);
-        pkt.stream_index = stream->stream->index;
-        ret = av_interleaved_write_frame(fi->output_ctx, &pkt);
-        av_packet_unref(&pkt);
-        if(ret < 0) {
-            err_printf("Error writing packet");
-        }
+trace_ring* get_thread_ring() {
+    unsigned generation = atomic_load_explicit(&tracer.generation, memory_order_acquire);
+    if(thread_ring && thread_ring_generation == generation) {
+        return thread_ring;
     }
+    trace_ring* ring = g2v_alloc_buffer(sizeof *ring);
+    if(!ring) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof *ring);
+    ring->tid = atomic_fetch_add(&tracer.next_tid, 1);
+    ring->next = atomic_load(&tracer.rings);
+    while(!atomic_compare_exchange_weak(&tracer.rings, &ring->next, ring));
+    thread_ring = ring;
+    thread_ring_generation = generation;
+    return ring;
+}
 
-    return ret == AVERROR_EOF ? G2V_EOF : G2V_TRUE;
+void trace_push(const char* name, char phase, double begin, double end, double value) {
+    if(!atomic_load_explicit(&tracer.enabled, memory_order_relaxed)) {
+        return;
+    }
+    trace_ring* ring = get_thread_ring();
+    if(!ring) {
+        return;
+    }
+    //Only this thread writes to the ring, the oldest events are overwritten when it is full
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_event* ev = &ring->events[head % TRACE_RING_SIZE];
+    ev->name = name;
+    ev->phase = phase;
+    ev->begin = begin;
+    ev->end = end;
+    ev->value = value;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-int ffmpeg_encode(g2v_render_ctx* ctx, g2v_encoder* encoder) {
-    ffmpeg_internals* fi = encoder->internal_data;
+void trace_span(const char* name, double begin, double end) {
+    trace_push(name, 'X', begin, end, 0);
+}
 
-    while(fi->audio.encoding || fi->video.encoding) {
-        int encode_audio = !fi->video.encoding;
-        if(!encode_audio) {
-            if(fi->audio.encoding) {
-                encode_audio = av_compare_ts(fi->video.next_pts, fi->video.codec_ctx->time_base, fi->audio.next_pts, fi->audio.codec_ctx->time_base) <= 0;
-            }
-        }
+void trace_counter(const char* name, double value) {
+    if(atomic_load_explicit(&tracer.enabled, memory_order_relaxed)) {
+        trace_push(name, 'C', stage_clock(), 0, value);
+    }
+}
 
-        if(!encode_audio) {
-            //Encode video
-            prepare_gl_state(ctx);
-            int eof = encoder->render_video_frame(ctx, encoder->user_ptr);
-            if(eof) {
-                fi->video.frame = NULL;
-            } else {
-                read_gl_data(ctx);
-                int in_linesize[1] = { 4 * ctx->width };
-                sws_scale(fi->sws_ctx, (uint8_t**)&ctx->pix_data, in_linesize, 0, ctx->height, fi->video.frame->data, fi->video.frame->linesize);
-            }
-            int ret = ffmpeg_write_frame(fi, &fi->video);
-            if(ret == G2V_FALSE) {
-                return G2V_FALSE;
-            } else if(ret == G2V_EOF) {
-                fi->video.encoding = G2V_FALSE;
-            }
-        } else {
-            
+void trace_thread_name(const char* name) {
+    if(atomic_load_explicit(&tracer.enabled, memory_order_relaxed)) {
+        trace_ring* ring = get_thread_ring();
+        if(ring) {
+            ring->thread_name = name;
         }
     }
+}
 
-    return G2V_TRUE;
+int trace_enabled() {
+    return atomic_load_explicit(&tracer.enabled, memory_order_relaxed);
 }
 
-int ffmpeg_create_stream(ffmpeg_internals* fi, AVOutputFormat* fmt, ffmpeg_output_stream* os, enum AVCodecID codec_id) {
-    os->codec = avcodec_find_encoder(codec_id);
-    if(!os->codec) {
-        err_printf("Encoder not found");
+int g2v_start_trace(const char* output_file) {
+    if(atomic_load(&tracer.enabled)) {
+        err_printf("Tracing already started");
         return G2V_FALSE;
     }
-    os->stream = avformat_new_stream(fi->output_ctx, NULL);
-    if(!os->stream) {
-        err_printf("Stream allocation failed");
+    g2v_free(tracer.output_file);
+    tracer.output_file = g2v_malloc(strlen(output_file) + 1);
+    strcpy(tracer.output_file, output_file);
+    tracer.origin = stage_clock();
+    tracer.gpu_offset = 0;
+    atomic_store(&tracer.next_tid, TRACE_GPU_TID + 1);
+    atomic_fetch_add(&tracer.generation, 1);
+    atomic_store(&tracer.enabled, G2V_TRUE);
+    trace_thread_name("gl2vid");
+    return G2V_TRUE;
+}
+
+int g2v_finish_trace() {
+    if(!atomic_load(&tracer.enabled)) {
+        err_printf("Tracing not started");
         return G2V_FALSE;
     }
-    os->stream->id = fi->output_ctx->nb_streams - 1;
-    AVCodecContext* c = avcodec_alloc_context3(os->codec);
-    if(!c) {
-        err_printf("Codec allocation failed");
-        return G2V_FALSE;
+    atomic_store(&tracer.enabled, G2V_FALSE);
+    trace_ring* rings = atomic_exchange(&tracer.rings, NULL);
+
+    FILE* f = fopen(tracer.output_file, "w");
+    if(!f) {
+        err_printf("Could not open trace file: %s", tracer.output_file);
+    } else {
+        fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", TRACE_GPU_TID);
+        for(trace_ring* ring = rings; ring; ring = ring->next) {
+            if(ring->thread_name) {
+                fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", ring->tid, ring->thread_name);
+            }
+            unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            unsigned first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+            for(unsigned i = first; i < head; i++) {
+                trace_event* ev = &ring->events[i % TRACE_RING_SIZE];
+                double ts = (ev->begin - tracer.origin) * 1e6;
+                if(ev->phase == 'C') {
+                    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"value\":%g}}", ev->name, ts, ring->tid, ev->value);
+                } else {
+                    //GPU events are recorded on the GL thread, but shown on their own track
+                    int tid = ev->phase == 'G' ? TRACE_GPU_TID : ring->tid;
+                    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}", ev->name, ts, (ev->end - ev->begin) * 1e6, tid);
+                }
+            }
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
     }
-    os->codec_ctx = c;
-    os->encoding = G2V_TRUE;
 
-    if (fi->output_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    while(rings) {
+        trace_ring* next = rings->next;
+        g2v_free_buffer(rings, sizeof *rings);
+        rings = next;
+    }
+    return f != NULL;
+}
 
+/*
+    GPU passes: fullscreen shader passes run on a rendered frame, before it is read back
+*/
 
-    return G2V_TRUE;
-}
+#define PASS_MAX_LEVELS 8
+#define REDUCE_BLOCK 16
 
-void ffmpeg_free_stream(ffmpeg_output_stream* stream) {
-    avcodec_free_context(&stream->codec_ctx);
-}
+enum { SLOT_FULL, SLOT_FLAT_CHECK, SLOT_FLAT };
 
-int g2v_create_ffmpeg_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, int fps, const char* output_file) {
-    ffmpeg_internals* fi = malloc(sizeof* fi);
-    avformat_alloc_output_context2(&fi->output_ctx, NULL, NULL, output_file);
-    if(!fi->output_ctx) {
-        err_printf("Could not allocate format context");
-        goto fail1;
-    }
-    AVOutputFormat* fmt = fi->output_ctx->oformat;
+//A post-process effect with its data on the GPU
+typedef struct {
+    g2v_effect_type type;
+    GLuint texture;
+    g2v_rect rect;
+    int lut_size;
+    float opacity;
+    float pad_color[3];
+} post_effect;
 
-    if(!ffmpeg_create_stream(fi, fmt, &fi->video, fmt->video_codec)) {
-        err_printf("Video stream creation failed");
-        goto fail2;
-    }
+struct g2v_passes {
+    GLuint vao;
+    //Renderbuffers can't be sampled, so with renderbuffer targets frames are copied here first
+    GLuint source_framebuffer, source_texture;
 
-    AVCodecContext* c = fi->video.codec_ctx;
-    c->codec_id = fmt->video_codec;
-    c->width = ctx->width;
-    c->height = ctx->height;
-    fi->video.stream->time_base = (AVRational) { 1, fps };
-    c->time_base = fi->video.stream->time_base;
-    c->pix_fmt = AV_PIX_FMT_YUV420P;
+    //Supersampling and accumulation: frames are rendered into scene_texture (render_width x render_height),
+    //then downscaled into their target, or into accum_texture for every sub-frame
+    GLuint scene_framebuffer, scene_texture;
+    GLuint accum_framebuffer, accum_texture;
+    GLuint downscale_program;
+    GLint downscale_src, downscale_scale, downscale_taps, downscale_weight;
 
-    if(avcodec_open2(c, fi->video.codec, NULL) < 0) {
-        err_printf("Could not open codec");
-        goto fail3;
-    }
+    //Post-process effects, applied in order between the ping-pong targets post_textures[]
+    post_effect* effects;
+    int effect_count;
+    GLuint post_framebuffers[2], post_textures[2];
+    GLuint lut_program, overlay_program, transform_program;
+    GLint lut_src, lut_table, lut_size;
+    GLint overlay_src, overlay_image, overlay_rect, overlay_opacity;
+    GLint transform_src, transform_src_rect, transform_dst_rect, transform_pad_color;
 
-    fi->video.frame = av_frame_alloc();
-    if(!fi->video.frame) {
-        err_printf("Could not allocate frame");
-        goto fail4;
-    }
+    //Flat frame detection: every level reduces REDUCE_BLOCK x REDUCE_BLOCK texels of the previous one, down to 1x1
+    int detect_flat;
+    GLuint reduce_program;
+    GLint reduce_src, reduce_compare;
+    int levels;
+    GLuint level_textures[PASS_MAX_LEVELS], level_framebuffers[PASS_MAX_LEVELS];
+    int level_width[PASS_MAX_LEVELS], level_height[PASS_MAX_LEVELS];
+    //8 bytes per target: the reduction result (1 byte, non-zero if any pixel differs) and the first pixel (4 bytes, at offset 4)
+    GLuint flat_pbo;
+    int slot_state[G2V_MAX_TARGETS];
+    int flat_colors[G2V_MAX_TARGETS];
 
-    fi->audio.encoding = G2V_FALSE;
-    fi->video.next_pts = 0;
-    fi->video.frame->width = c->width;
-    fi->video.frame->height = c->height;
-    fi->video.frame->format = c->pix_fmt;
-    
-    if(av_frame_get_buffer(fi->video.frame, 32) < 0) {
-        err_printf("Could not allocate raw picture buffer");
-        goto fail5;
-    }
+    //Planar readback (G2V_PIXELS_GBRP): planes_program writes the G, B and R planes into the three attachments of planes_framebuffer
+    GLuint planes_program;
+    GLint planes_src;
+    GLuint planes_framebuffer, planes_textures[3];
+};
 
-    fi->sws_ctx = sws_getContext(ctx->width, ctx->height, AV_PIX_FMT_RGB32, ctx->width, ctx->height, AV_PIX_FMT_YUV420P, 0, NULL, NULL, NULL);
-    if(!fi->sws_ctx) {
-        err_printf("Could not allocate SwsContext");
-        goto fail6;
-    }
+//Vertex shader of every pass: a single triangle covering the viewport, without any vertex buffer
+const char* pass_vertex_source =
+    "#version 130\n"
+    "void main() {\n"
+    "    vec2 p = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
 
-    if(avcodec_parameters_from_context(fi->video.stream->codecpar, c) < 0) {
-        err_printf("Could not copy encoding parameters");
-        goto fail6;
-    }
+//Outputs 1 if any texel of its block differs from the first texel of src (compare != 0), or the maximum of the block otherwise
+const char* reduce_fragment_source =
+    "#version 130\n"
+    "uniform sampler2D src;\n"
+    "uniform int compare;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    ivec2 size = textureSize(src, 0);\n"
+    "    ivec2 origin = ivec2(gl_FragCoord.xy) * 16;\n"
+    "    ivec2 end = min(origin + 16, size);\n"
+    "    vec4 reference = texelFetch(src, ivec2(0), 0);\n"
+    "    float differs = 0.0;\n"
+    "    for(int y = origin.y; y < end.y; y++) {\n"
+    "        for(int x = origin.x; x < end.x; x++) {\n"
+    "            vec4 t = texelFetch(src, ivec2(x, y), 0);\n"
+    "            differs = max(differs, compare != 0 ? float(t != reference) : t.r);\n"
+    "        }\n"
+    "    }\n"
+    "    color = vec4(differs);\n"
+    "}\n";
 
-    av_dump_format(fi->output_ctx, 0, output_file, 1);
+//Box filter: averages taps x taps bilinear samples spread evenly over the source footprint of the pixel
+const char* downscale_fragment_source =
+    "#version 130\n"
+    "uniform sampler2D src;\n"
+    "uniform vec2 scale;\n"
+    "uniform ivec2 taps;\n"
+    "uniform float weight;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    vec2 size = vec2(textureSize(src, 0));\n"
+    "    vec2 origin = floor(gl_FragCoord.xy) * scale;\n"
+    "    vec2 step = scale / vec2(taps);\n"
+    "    vec4 sum = vec4(0.0);\n"
+    "    for(int y = 0; y < taps.y; y++) {\n"
+    "        for(int x = 0; x < taps.x; x++) {\n"
+    "            sum += texture(src, (origin + (vec2(x, y) + 0.5) * step) / size);\n"
+    "        }\n"
+    "    }\n"
+    "    color = sum * (weight / float(taps.x * taps.y));\n"
+    "}\n";
 
-    if (!(fmt->flags & AVFMT_NOFILE)) {
-        if(avio_open(&fi->output_ctx->pb, output_file, AVIO_FLAG_WRITE) < 0) {
-            err_printf("Could not open file: %s", output_file);
-            goto fail6;
-        }
-    }
+const char* lut_fragment_source =
+    "#version 130\n"
+    "uniform sampler2D src;\n"
+    "uniform sampler3D lut;\n"
+    "uniform float lut_size;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    vec4 c = texelFetch(src, ivec2(gl_FragCoord.xy), 0);\n"
+    //Entries are at the texel centers
+    "    vec3 coord = c.rgb * ((lut_size - 1.0) / lut_size) + 0.5 / lut_size;\n"
+    "    color = vec4(texture(lut, coord).rgb, c.a);\n"
+    "}\n";
 
-    if(avformat_write_header(fi->output_ctx, NULL) < 0) {
-        err_printf("Could not write header for file: %s", output_file);
-        goto fail7;
-    }
+const char* overlay_fragment_source =
+    "#version 130\n"
+    "uniform sampler2D src;\n"
+    "uniform sampler2D image;\n"
+    "uniform vec4 rect;\n"
+    "uniform float opacity;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    color = texelFetch(src, ivec2(gl_FragCoord.xy), 0);\n"
+    "    vec2 uv = (gl_FragCoord.xy - rect.xy) / rect.zw;\n"
+    "    if(all(greaterThanEqual(uv, vec2(0.0))) && all(lessThan(uv, vec2(1.0)))) {\n"
+    //The image rows go from top to bottom
+    "        vec4 o = texture(image, vec2(uv.x, 1.0 - uv.y));\n"
+    "        color.rgb = mix(color.rgb, o.rgb, o.a * opacity);\n"
+    "    }\n"
+    "}\n";
 
-    enc->internal_data = fi;
-    enc->encode_fn = ffmpeg_encode;
+//Splits the frame into one plane per render target, rows from top to bottom like pix_data
+const char* planes_fragment_source =
+    "#version 130\n"
+    "uniform sampler2D src;\n"
+    "out float g;\n"
+    "out float b;\n"
+    "out float r;\n"
+    "void main() {\n"
+    "    ivec2 p = ivec2(gl_FragCoord.xy);\n"
+    "    vec4 c = texelFetch(src, ivec2(p.x, textureSize(src, 0).y - 1 - p.y), 0);\n"
+    "    g = c.g;\n"
+    "    b = c.b;\n"
+    "    r = c.r;\n"
+    "}\n";
 
-    return G2V_TRUE;
+//Maps src_rect of the source onto dst_rect, everything else (or outside of the source) gets the padding color
+const char* transform_fragment_source =
+    "#version 130\n"
+    "uniform sampler2D src;\n"
+    "uniform vec4 src_rect;\n"
+    "uniform vec4 dst_rect;\n"
+    "uniform vec3 pad_color;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    vec2 size = vec2(textureSize(src, 0));\n"
+    "    vec2 uv = (gl_FragCoord.xy - dst_rect.xy) / dst_rect.zw;\n"
+    "    vec2 p = src_rect.xy + uv * src_rect.zw;\n"
+    "    if(any(lessThan(uv, vec2(0.0))) || any(greaterThanEqual(uv, vec2(1.0))) || any(lessThan(p, vec2(0.0))) || any(greaterThanEqual(p, size))) {\n"
+    "        color = vec4(pad_color, 1.0);\n"
+    "    } else {\n"
+    "        color = texture(src, p / size);\n"
+    "    }\n"
+    "}\n";
 
-fail7:
-    avio_closep(&fi->output_ctx->pb);
-fail6:
-    sws_freeContext(fi->sws_ctx);
-fail5:
-    av_freep(&fi->video.frame->data[0]);
-fail4:
-    av_frame_free(&fi->video.frame);
-fail3:
-    ffmpeg_free_stream(&fi->video);
-fail2:
-    avformat_free_context(fi->output_ctx);
-fail1:
-    free(fi);
-    return G2V_FALSE;
+static GLuint compile_shader(GLenum type, const char* source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if(!status) {
+        char log[200];
+        glGetShaderInfoLog(shader, sizeof log, NULL, log);
+        err_printf("Could not compile shader: %s", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
 }
 
-//Not supported
-int g2v_init_ffmpeg_audio_stream(g2v_encoder* enc) {
-    return G2V_FALSE;
+//Links a fragment shader with the fullscreen triangle vertex shader, returns 0 if failed
+static GLuint create_pass_program(const char* fragment_source) {
+    GLuint vertex = compile_shader(GL_VERTEX_SHADER, pass_vertex_source);
+    if(!vertex) {
+        return 0;
+    }
+    GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if(!fragment) {
+        glDeleteShader(vertex);
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if(!status) {
+        char log[200];
+        glGetProgramInfoLog(program, sizeof log, NULL, log);
+        err_printf("Could not link shader program: %s", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
 }
 
-int g2v_finish_ffmpeg_encoder(g2v_encoder* enc) {
-    ffmpeg_internals* fi = enc->internal_data;
+static GLuint create_target_texture(GLenum internal_format, int width, int height) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return texture;
+}
 
-    av_write_trailer(fi->output_ctx);
-    avio_closep(&fi->output_ctx->pb);
-    sws_freeContext(fi->sws_ctx);
-    av_freep(&fi->video.frame->data[0]);
-    av_frame_free(&fi->video.frame);
+//Bilinear filtering of the texture bound to target, without wrapping around
+void set_linear_filtering(GLenum target) {
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if(target == GL_TEXTURE_3D) {
+        glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    }
+}
+
+static GLuint create_texture_framebuffer(GLuint texture) {
+    GLuint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    return framebuffer;
+}
+
+//The state a pass changes, restored afterwards so that it doesn't leak into render_video_frame
+typedef struct {
+    GLint program, vao, active_texture, texture, texture1, texture1_3d, draw_framebuffer, read_framebuffer;
+    GLint viewport[4];
+    GLint blend_equation[2], blend_func[4];
+    GLboolean blend, depth_test, stencil_test, scissor_test, cull_face;
+} pass_state;
+
+static void begin_pass(pass_state* saved) {
+    glGetIntegerv(GL_CURRENT_PROGRAM, &saved->program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &saved->vao);
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &saved->active_texture);
+    //Effects bind their own textures to unit 1
+    glActiveTexture(GL_TEXTURE1);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &saved->texture1);
+    glGetIntegerv(GL_TEXTURE_BINDING_3D, &saved->texture1_3d);
+    glActiveTexture(GL_TEXTURE0);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &saved->texture);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &saved->draw_framebuffer);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &saved->read_framebuffer);
+    glGetIntegerv(GL_VIEWPORT, saved->viewport);
+    glGetIntegerv(GL_BLEND_EQUATION_RGB, &saved->blend_equation[0]);
+    glGetIntegerv(GL_BLEND_EQUATION_ALPHA, &saved->blend_equation[1]);
+    glGetIntegerv(GL_BLEND_SRC_RGB, &saved->blend_func[0]);
+    glGetIntegerv(GL_BLEND_DST_RGB, &saved->blend_func[1]);
+    glGetIntegerv(GL_BLEND_SRC_ALPHA, &saved->blend_func[2]);
+    glGetIntegerv(GL_BLEND_DST_ALPHA, &saved->blend_func[3]);
+    saved->blend = glIsEnabled(GL_BLEND);
+    saved->depth_test = glIsEnabled(GL_DEPTH_TEST);
+    saved->stencil_test = glIsEnabled(GL_STENCIL_TEST);
+    saved->scissor_test = glIsEnabled(GL_SCISSOR_TEST);
+    saved->cull_face = glIsEnabled(GL_CULL_FACE);
+    glDisable(GL_BLEND);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_STENCIL_TEST);
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_CULL_FACE);
+}
+
+static void set_capability(GLenum cap, GLboolean enabled) {
+    if(enabled) {
+        glEnable(cap);
+    } else {
+        glDisable(cap);
+    }
+}
+
+static void end_pass(const pass_state* saved) {
+    glUseProgram(saved->program);
+    glBindVertexArray(saved->vao);
+    glBindTexture(GL_TEXTURE_2D, saved->texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, saved->texture1);
+    glBindTexture(GL_TEXTURE_3D, saved->texture1_3d);
+    glActiveTexture(saved->active_texture);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, saved->draw_framebuffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, saved->read_framebuffer);
+    glViewport(saved->viewport[0], saved->viewport[1], saved->viewport[2], saved->viewport[3]);
+    glBlendEquationSeparate(saved->blend_equation[0], saved->blend_equation[1]);
+    glBlendFuncSeparate(saved->blend_func[0], saved->blend_func[1], saved->blend_func[2], saved->blend_func[3]);
+    set_capability(GL_BLEND, saved->blend);
+    set_capability(GL_DEPTH_TEST, saved->depth_test);
+    set_capability(GL_STENCIL_TEST, saved->stencil_test);
+    set_capability(GL_SCISSOR_TEST, saved->scissor_test);
+    set_capability(GL_CULL_FACE, saved->cull_face);
+}
+
+//Draws the fullscreen triangle into framebuffer, with the program and textures already bound
+static void draw_pass(g2v_passes* passes, GLuint framebuffer, int width, int height) {
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffer);
+    glViewport(0, 0, width, height);
+    glBindVertexArray(passes->vao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+//Texture holding the frame rendered into target idx
+static GLuint pass_source_texture(g2v_render_ctx* ctx, int idx) {
+#ifdef G2V_TARGET_RENDERBUFFER
+    g2v_passes* passes = ctx->passes;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->framebuffers[idx]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, passes->source_framebuffer);
+    glBlitFramebuffer(0, 0, ctx->width, ctx->height, 0, 0, ctx->width, ctx->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    return passes->source_texture;
+#else
+    return ctx->textures[idx];
+#endif
+}
+
+static void free_passes(g2v_passes* passes) {
+    if(!passes) {
+        return;
+    }
+    glDeleteVertexArrays(1, &passes->vao);
+    glDeleteFramebuffers(1, &passes->source_framebuffer);
+    glDeleteTextures(1, &passes->source_texture);
+    glDeleteFramebuffers(1, &passes->scene_framebuffer);
+    glDeleteTextures(1, &passes->scene_texture);
+    glDeleteFramebuffers(1, &passes->accum_framebuffer);
+    glDeleteTextures(1, &passes->accum_texture);
+    glDeleteProgram(passes->downscale_program);
+    for(int i = 0; i < passes->effect_count; i++) {
+        glDeleteTextures(1, &passes->effects[i].texture);
+    }
+    g2v_free(passes->effects);
+    glDeleteFramebuffers(2, passes->post_framebuffers);
+    glDeleteTextures(2, passes->post_textures);
+    glDeleteProgram(passes->lut_program);
+    glDeleteProgram(passes->overlay_program);
+    glDeleteProgram(passes->transform_program);
+    glDeleteProgram(passes->reduce_program);
+    glDeleteFramebuffers(passes->levels, passes->level_framebuffers);
+    glDeleteTextures(passes->levels, passes->level_textures);
+    glDeleteBuffers(1, &passes->flat_pbo);
+    glDeleteProgram(passes->planes_program);
+    glDeleteFramebuffers(1, &passes->planes_framebuffer);
+    glDeleteTextures(3, passes->planes_textures);
+    g2v_free(passes);
+}
+
+static int init_flat_detection(g2v_render_ctx* ctx, g2v_passes* passes) {
+    passes->reduce_program = create_pass_program(reduce_fragment_source);
+    if(!passes->reduce_program) {
+        return G2V_FALSE;
+    }
+    passes->reduce_src = glGetUniformLocation(passes->reduce_program, "src");
+    passes->reduce_compare = glGetUniformLocation(passes->reduce_program, "compare");
+
+    int width = ctx->width, height = ctx->height;
+    do {
+        width = (width + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+        height = (height + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+        int level = passes->levels++;
+        passes->level_width[level] = width;
+        passes->level_height[level] = height;
+        passes->level_textures[level] = create_target_texture(GL_R8, width, height);
+        passes->level_framebuffers[level] = create_texture_framebuffer(passes->level_textures[level]);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            err_printf("Could not create reduction framebuffer");
+            return G2V_FALSE;
+        }
+    } while((width > 1 || height > 1) && passes->levels < PASS_MAX_LEVELS);
+
+    glGenBuffers(1, &passes->flat_pbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, passes->flat_pbo);
+    glBufferData(GL_PIXEL_PACK_BUFFER, G2V_MAX_TARGETS * 8, NULL, GL_STREAM_READ);
+    passes->detect_flat = G2V_TRUE;
+    return G2V_TRUE;
+}
+
+int init_planes(g2v_render_ctx* ctx, g2v_passes* passes) {
+    passes->planes_program = create_pass_program(planes_fragment_source);
+    if(!passes->planes_program) {
+        return G2V_FALSE;
+    }
+    //Every output goes to its own attachment, which takes linking the program again
+    const char* outputs[3] = { "g", "b", "r" };
+    GLenum buffers[3];
+    for(int i = 0; i < 3; i++) {
+        glBindFragDataLocation(passes->planes_program, i, outputs[i]);
+        buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    glLinkProgram(passes->planes_program);
+    GLint status;
+    glGetProgramiv(passes->planes_program, GL_LINK_STATUS, &status);
+    if(!status) {
+        err_printf("Could not link plane shader program");
+        return G2V_FALSE;
+    }
+    passes->planes_src = glGetUniformLocation(passes->planes_program, "src");
+
+    glGenFramebuffers(1, &passes->planes_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, passes->planes_framebuffer);
+    for(int i = 0; i < 3; i++) {
+        passes->planes_textures[i] = create_target_texture(GL_R8, ctx->width, ctx->height);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, buffers[i], GL_TEXTURE_2D, passes->planes_textures[i], 0);
+    }
+    glDrawBuffers(3, buffers);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        err_printf("Could not create plane framebuffer");
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+int init_downscale_program(g2v_passes* passes) {
+    passes->downscale_program = create_pass_program(downscale_fragment_source);
+    if(!passes->downscale_program) {
+        return G2V_FALSE;
+    }
+    passes->downscale_src = glGetUniformLocation(passes->downscale_program, "src");
+    passes->downscale_scale = glGetUniformLocation(passes->downscale_program, "scale");
+    passes->downscale_taps = glGetUniformLocation(passes->downscale_program, "taps");
+    passes->downscale_weight = glGetUniformLocation(passes->downscale_program, "weight");
+    return G2V_TRUE;
+}
+
+//With renderbuffer targets, frames are copied into source_texture before a pass can sample them
+void init_source_texture(g2v_render_ctx* ctx, g2v_passes* passes) {
+#ifdef G2V_TARGET_RENDERBUFFER
+    passes->source_texture = create_target_texture(GL_RGBA8, ctx->width, ctx->height);
+    passes->source_framebuffer = create_texture_framebuffer(passes->source_texture);
+#endif
+}
+
+g2v_passes* alloc_passes() {
+    g2v_passes* passes = g2v_calloc(1, sizeof *passes);
+    if(!passes) {
+        err_printf("Could not allocate passes");
+        return NULL;
+    }
+    glGenVertexArrays(1, &passes->vao);
+    return passes;
+}
+
+static int init_scene(g2v_render_ctx* ctx, g2v_passes* passes) {
+    if(!init_downscale_program(passes)) {
+        return G2V_FALSE;
+    }
+
+    passes->scene_texture = create_target_texture(GL_RGBA8, ctx->render_width, ctx->render_height);
+    //Bilinear, for the samples of fractional factors which fall between texels
+    set_linear_filtering(GL_TEXTURE_2D);
+    passes->scene_framebuffer = create_texture_framebuffer(passes->scene_texture);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        err_printf("Could not create %dx%d scene framebuffer", ctx->render_width, ctx->render_height);
+        return G2V_FALSE;
+    }
+
+    if(ctx->accumulate > 1) {
+        //32 bit floats, so that adding up many sub-frames loses nothing
+        passes->accum_texture = create_target_texture(GL_RGBA32F, ctx->width, ctx->height);
+        passes->accum_framebuffer = create_texture_framebuffer(passes->accum_texture);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            err_printf("Could not create floating point accumulation framebuffer");
+            return G2V_FALSE;
+        }
+    }
+    return G2V_TRUE;
+}
+
+int init_effect(post_effect* effect, const g2v_effect* desc) {
+    effect->type = desc->type;
+    effect->rect = desc->rect;
+    effect->opacity = desc->opacity;
+    effect->pad_color[0] = (desc->pad_color >> 16 & 0xff) / 255.0f;
+    effect->pad_color[1] = (desc->pad_color >> 8 & 0xff) / 255.0f;
+    effect->pad_color[2] = (desc->pad_color & 0xff) / 255.0f;
+    switch(desc->type) {
+    case G2V_EFFECT_LUT:
+        if(!desc->lut || desc->lut_size < 2) {
+            err_printf("Invalid LUT of size %d", desc->lut_size);
+            return G2V_FALSE;
+        }
+        effect->lut_size = desc->lut_size;
+        glGenTextures(1, &effect->texture);
+        glBindTexture(GL_TEXTURE_3D, effect->texture);
+        glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB32F, desc->lut_size, desc->lut_size, desc->lut_size, 0, GL_RGB, GL_FLOAT, desc->lut);
+        //Trilinear interpolation between the entries
+        set_linear_filtering(GL_TEXTURE_3D);
+        return G2V_TRUE;
+    case G2V_EFFECT_OVERLAY:
+        if(!desc->image || desc->image_width <= 0 || desc->image_height <= 0) {
+            err_printf("Invalid overlay image of %dx%d", desc->image_width, desc->image_height);
+            return G2V_FALSE;
+        }
+        //Without a size, the image is drawn 1:1
+        effect->rect.width = desc->rect.width > 0 ? desc->rect.width : desc->image_width;
+        effect->rect.height = desc->rect.height > 0 ? desc->rect.height : desc->image_height;
+        glGenTextures(1, &effect->texture);
+        glBindTexture(GL_TEXTURE_2D, effect->texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, desc->image_width, desc->image_height, 0, GL_BGRA, GL_UNSIGNED_BYTE, desc->image);
+        set_linear_filtering(GL_TEXTURE_2D);
+        return G2V_TRUE;
+    case G2V_EFFECT_CROP:
+    case G2V_EFFECT_SCALE:
+        if(desc->rect.width <= 0 || desc->rect.height <= 0) {
+            err_printf("Invalid effect rectangle of %dx%d", desc->rect.width, desc->rect.height);
+            return G2V_FALSE;
+        }
+        return G2V_TRUE;
+    }
+    err_printf("Unknown effect type %d", (int)desc->type);
+    return G2V_FALSE;
+}
+
+int init_effects(g2v_render_ctx* ctx, g2v_passes* passes, const g2v_render_options* opts) {
+    passes->lut_program = create_pass_program(lut_fragment_source);
+    passes->overlay_program = create_pass_program(overlay_fragment_source);
+    passes->transform_program = create_pass_program(transform_fragment_source);
+    if(!passes->lut_program || !passes->overlay_program || !passes->transform_program) {
+        return G2V_FALSE;
+    }
+    passes->lut_src = glGetUniformLocation(passes->lut_program, "src");
+    passes->lut_table = glGetUniformLocation(passes->lut_program, "lut");
+    passes->lut_size = glGetUniformLocation(passes->lut_program, "lut_size");
+    passes->overlay_src = glGetUniformLocation(passes->overlay_program, "src");
+    passes->overlay_image = glGetUniformLocation(passes->overlay_program, "image");
+    passes->overlay_rect = glGetUniformLocation(passes->overlay_program, "rect");
+    passes->overlay_opacity = glGetUniformLocation(passes->overlay_program, "opacity");
+    passes->transform_src = glGetUniformLocation(passes->transform_program, "src");
+    passes->transform_src_rect = glGetUniformLocation(passes->transform_program, "src_rect");
+    passes->transform_dst_rect = glGetUniformLocation(passes->transform_program, "dst_rect");
+    passes->transform_pad_color = glGetUniformLocation(passes->transform_program, "pad_color");
+
+    passes->effects = g2v_calloc(opts->effect_count, sizeof *passes->effects);
+    if(!passes->effects) {
+        err_printf("Could not allocate effects");
+        return G2V_FALSE;
+    }
+    for(int i = 0; i < opts->effect_count; i++) {
+        if(!init_effect(&passes->effects[passes->effect_count++], &opts->effects[i])) {
+            return G2V_FALSE;
+        }
+    }
+
+    for(int i = 0; i < 2; i++) {
+        passes->post_textures[i] = create_target_texture(GL_RGBA8, ctx->width, ctx->height);
+        set_linear_filtering(GL_TEXTURE_2D);
+        passes->post_framebuffers[i] = create_texture_framebuffer(passes->post_textures[i]);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            err_printf("Could not create post-process framebuffer");
+            return G2V_FALSE;
+        }
+    }
+    return G2V_TRUE;
+}
+
+int is_supersampled(const g2v_render_ctx* ctx) {
+    return ctx->render_width != ctx->width || ctx->render_height != ctx->height;
+}
+
+//Whether frames are rendered into the scene target, and go through a pass before reaching their own target
+static int has_scene(const g2v_render_ctx* ctx) {
+    return is_supersampled(ctx) || ctx->accumulate > 1;
+}
+
+static int init_passes(g2v_render_ctx* ctx, const g2v_render_options* opts) {
+    ctx->passes = NULL;
+    int planar = ctx->pixel_format == G2V_PIXELS_GBRP;
+    if(!opts->detect_flat && !has_scene(ctx) && opts->effect_count <= 0 && !planar) {
+        return G2V_TRUE;
+    }
+    g2v_passes* passes = alloc_passes();
+    if(!passes) {
+        return G2V_FALSE;
+    }
+    if(opts->detect_flat || opts->effect_count > 0 || planar) {
+        init_source_texture(ctx, passes);
+    }
+    if(has_scene(ctx) && !init_scene(ctx, passes)) {
+        free_passes(passes);
+        return G2V_FALSE;
+    }
+    if(opts->effect_count > 0 && !init_effects(ctx, passes, opts)) {
+        free_passes(passes);
+        return G2V_FALSE;
+    }
+    if(opts->detect_flat && !init_flat_detection(ctx, passes)) {
+        free_passes(passes);
+        return G2V_FALSE;
+    }
+    if(planar && !init_planes(ctx, passes)) {
+        free_passes(passes);
+        return G2V_FALSE;
+    }
+    ctx->passes = passes;
+    return G2V_TRUE;
+}
+
+/**
+ * Let the frames of ctx be downscaled into other render contexts (see downscale_target()),
+ * creating the passes of ctx if it has none.
+ */
+int init_downscale_source(g2v_render_ctx* ctx) {
+    if(!ctx->passes && !(ctx->passes = alloc_passes())) {
+        return G2V_FALSE;
+    }
+    g2v_passes* passes = ctx->passes;
+#ifdef G2V_TARGET_RENDERBUFFER
+    if(!passes->source_texture) {
+        init_source_texture(ctx, passes);
+    }
+#endif
+    return passes->downscale_program || init_downscale_program(passes);
+}
+
+//Draw texture (of src_width x src_height) into framebuffer of width x height, box filtered and multiplied by weight
+static void draw_downscale(g2v_passes* passes, GLuint texture, int src_width, int src_height, GLuint framebuffer, int width, int height, float weight) {
+    glUseProgram(passes->downscale_program);
+    glUniform1i(passes->downscale_src, 0);
+    glUniform2f(passes->downscale_scale, (float)src_width / width, (float)src_height / height);
+    glUniform2i(passes->downscale_taps, (src_width + width - 1) / width, (src_height + height - 1) / height);
+    glUniform1f(passes->downscale_weight, weight);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    draw_pass(passes, framebuffer, width, height);
+}
+
+/**
+ * Downscale the frame in target idx of ctx into the targets of the frames being rendered in dsts[0..count).
+ */
+void downscale_target(g2v_render_ctx* ctx, int idx, g2v_render_ctx* const* dsts, int count) {
+    g2v_passes* passes = ctx->passes;
+    pass_state saved;
+    begin_pass(&saved);
+
+    //Copied once for all of them with renderbuffer targets
+    GLuint src = pass_source_texture(ctx, idx);
+    glBindTexture(GL_TEXTURE_2D, src);
+    set_linear_filtering(GL_TEXTURE_2D);
+    for(int i = 0; i < count; i++) {
+        const g2v_render_ctx* dst = dsts[i];
+        draw_downscale(passes, src, ctx->width, ctx->height, dst->framebuffers[dst->current_frame_index % dst->targets], dst->width, dst->height, 1.0f);
+    }
+
+    end_pass(&saved);
+}
+
+/**
+ * Downscale the scene into target idx, or with accumulation add it to the accumulation target,
+ * which is copied into target idx after the last sub-frame.
+ */
+static void resolve_scene(g2v_render_ctx* ctx, int idx) {
+    g2v_passes* passes = ctx->passes;
+    pass_state saved;
+    begin_pass(&saved);
+
+    if(ctx->accumulate > 1) {
+        //The first sub-frame replaces what is left of the previous frame, the next ones are added to it
+        if(ctx->accumulate_index > 0) {
+            glEnable(GL_BLEND);
+            glBlendEquation(GL_FUNC_ADD);
+            glBlendFunc(GL_ONE, GL_ONE);
+        }
+        draw_downscale(passes, passes->scene_texture, ctx->render_width, ctx->render_height, passes->accum_framebuffer, ctx->width, ctx->height, 1.0f / ctx->accumulate);
+        glDisable(GL_BLEND);
+        if(ctx->accumulate_index == ctx->accumulate - 1) {
+            draw_downscale(passes, passes->accum_texture, ctx->width, ctx->height, ctx->framebuffers[idx], ctx->width, ctx->height, 1.0f);
+        }
+    } else {
+        draw_downscale(passes, passes->scene_texture, ctx->render_width, ctx->render_height, ctx->framebuffers[idx], ctx->width, ctx->height, 1.0f);
+    }
+
+    end_pass(&saved);
+}
+
+//Draw effect applied to the texture src into framebuffer
+void draw_effect(g2v_render_ctx* ctx, const post_effect* effect, GLuint src, GLuint framebuffer) {
+    g2v_passes* passes = ctx->passes;
+    const g2v_rect* r = &effect->rect;
+    glBindTexture(GL_TEXTURE_2D, src);
+    switch(effect->type) {
+    case G2V_EFFECT_LUT:
+        glUseProgram(passes->lut_program);
+        glUniform1i(passes->lut_src, 0);
+        glUniform1i(passes->lut_table, 1);
+        glUniform1f(passes->lut_size, (float)effect->lut_size);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_3D, effect->texture);
+        glActiveTexture(GL_TEXTURE0);
+        break;
+    case G2V_EFFECT_OVERLAY:
+        glUseProgram(passes->overlay_program);
+        glUniform1i(passes->overlay_src, 0);
+        glUniform1i(passes->overlay_image, 1);
+        glUniform4f(passes->overlay_rect, (float)r->x, (float)r->y, (float)r->width, (float)r->height);
+        glUniform1f(passes->overlay_opacity, effect->opacity);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, effect->texture);
+        glActiveTexture(GL_TEXTURE0);
+        break;
+    case G2V_EFFECT_CROP:
+    case G2V_EFFECT_SCALE:
+        glUseProgram(passes->transform_program);
+        glUniform1i(passes->transform_src, 0);
+        if(effect->type == G2V_EFFECT_CROP) {
+            glUniform4f(passes->transform_src_rect, (float)r->x, (float)r->y, (float)r->width, (float)r->height);
+            glUniform4f(passes->transform_dst_rect, 0.0f, 0.0f, (float)ctx->width, (float)ctx->height);
+        } else {
+            glUniform4f(passes->transform_src_rect, 0.0f, 0.0f, (float)ctx->width, (float)ctx->height);
+            glUniform4f(passes->transform_dst_rect, (float)r->x, (float)r->y, (float)r->width, (float)r->height);
+        }
+        glUniform3fv(passes->transform_pad_color, 1, effect->pad_color);
+        //Render targets are created with nearest filtering, scaling needs bilinear
+        set_linear_filtering(GL_TEXTURE_2D);
+        break;
+    }
+    draw_pass(passes, framebuffer, ctx->width, ctx->height);
+}
+
+/**
+ * Run the post-process effects on the frame of target idx, each one reading what the previous one wrote.
+ */
+void apply_effects(g2v_render_ctx* ctx, int idx) {
+    g2v_passes* passes = ctx->passes;
+    pass_state saved;
+    begin_pass(&saved);
+
+    GLuint src = pass_source_texture(ctx, idx);
+    GLuint dst = 0;
+    for(int i = 0; i < passes->effect_count; i++) {
+        //The last effect writes the target directly, unless it reads it too (a single effect on texture targets)
+        int direct = i == passes->effect_count - 1 && (i > 0 || passes->source_framebuffer);
+        dst = direct ? ctx->framebuffers[idx] : passes->post_framebuffers[i % 2];
+        draw_effect(ctx, &passes->effects[i], src, dst);
+        src = passes->post_textures[i % 2];
+    }
+    if(dst != ctx->framebuffers[idx]) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, dst);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, ctx->framebuffers[idx]);
+        glBlitFramebuffer(0, 0, ctx->width, ctx->height, 0, 0, ctx->width, ctx->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+
+    end_pass(&saved);
+}
+
+/**
+ * Reduce the frame of target idx on the GPU and queue the readback of the result and of the first pixel.
+ */
+static void detect_flat_frame(g2v_render_ctx* ctx, int idx) {
+    g2v_passes* passes = ctx->passes;
+    pass_state saved;
+    begin_pass(&saved);
+
+    GLuint src = pass_source_texture(ctx, idx);
+    glUseProgram(passes->reduce_program);
+    glUniform1i(passes->reduce_src, 0);
+    for(int level = 0; level < passes->levels; level++) {
+        glBindTexture(GL_TEXTURE_2D, src);
+        glUniform1i(passes->reduce_compare, level == 0);
+        draw_pass(passes, passes->level_framebuffers[level], passes->level_width[level], passes->level_height[level]);
+        src = passes->level_textures[level];
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, passes->flat_pbo);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, passes->level_framebuffers[passes->levels - 1]);
+    glReadPixels(0, 0, 1, 1, GL_RED, GL_UNSIGNED_BYTE, (void*)(intptr_t)(idx * 8));
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->framebuffers[idx]);
+    glReadPixels(0, 0, 1, 1, GL_BGRA, GL_UNSIGNED_BYTE, (void*)(intptr_t)(idx * 8 + 4));
+    ctx->timings->readback_bytes += 5;
+
+    end_pass(&saved);
+    passes->slot_state[idx] = SLOT_FLAT_CHECK;
+}
+
+/**
+ * Split the frame of target idx into its planes on the GPU and queue their readback, one after the other in its PBO.
+ */
+void read_planes(g2v_render_ctx* ctx, int idx) {
+    g2v_passes* passes = ctx->passes;
+    pass_state saved;
+    begin_pass(&saved);
+
+    GLuint src = pass_source_texture(ctx, idx);
+    glUseProgram(passes->planes_program);
+    glUniform1i(passes->planes_src, 0);
+    glBindTexture(GL_TEXTURE_2D, src);
+    draw_pass(passes, passes->planes_framebuffer, ctx->width, ctx->height);
+
+    size_t plane_size = (size_t)ctx->width * ctx->height;
+    GLint alignment;
+    glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+    //Rows of a plane are width bytes, without padding
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, passes->planes_framebuffer);
+    for(int i = 0; i < 3; i++) {
+        glReadBuffer(GL_COLOR_ATTACHMENT0 + i);
+        glReadPixels(0, 0, ctx->width, ctx->height, GL_RED, GL_UNSIGNED_BYTE, (void*)(intptr_t)(i * plane_size));
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+    ctx->timings->readback_bytes += 3 * plane_size;
+
+    end_pass(&saved);
+}
+
+/**
+ * Once the detection of target idx has completed, either mark it flat or queue its full readback.
+ * Returns G2V_FALSE if the result is not available yet and wait is not set.
+ */
+static int resolve_flat_check(g2v_render_ctx* ctx, int idx, int wait) {
+    g2v_passes* passes = ctx->passes;
+    if(!passes || passes->slot_state[idx] != SLOT_FLAT_CHECK) {
+        return G2V_TRUE;
+    }
+    if(ctx->fences[idx]) {
+        if(wait) {
+            while(glClientWaitSync(ctx->fences[idx], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        } else {
+            GLenum status = glClientWaitSync(ctx->fences[idx], 0, 0);
+            if(status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+                return G2V_FALSE;
+            }
+        }
+        glDeleteSync(ctx->fences[idx]);
+        ctx->fences[idx] = NULL;
+    } else if(!wait) {
+        return G2V_FALSE;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, passes->flat_pbo);
+    const unsigned char* result = glMapBufferRange(GL_PIXEL_PACK_BUFFER, idx * 8, 8, GL_MAP_READ_BIT);
+    int differs = result[0] != 0;
+    memcpy(&passes->flat_colors[idx], result + 4, sizeof(int));
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+
+    if(!differs) {
+        passes->slot_state[idx] = SLOT_FLAT;
+        return G2V_TRUE;
+    }
+
+    GLint read_framebuffer;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_framebuffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->framebuffers[idx]);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+    glReadPixels(0, 0, ctx->width, ctx->height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+    ctx->timings->readback_bytes += sizeof(int) * ctx->width * ctx->height;
+    if(GLAD_GL_ARB_sync) {
+        ctx->fences[idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+    }
+    passes->slot_state[idx] = SLOT_FULL;
+    return G2V_TRUE;
+}
+
+//Resolve the detection of pending frames in order, without waiting, so their full readback starts as early as possible
+static void resolve_flat_checks(g2v_render_ctx* ctx) {
+    if(!ctx->passes) {
+        return;
+    }
+    for(int i = ctx->pending_frames; i > 0; i--) {
+        if(!resolve_flat_check(ctx, (ctx->current_frame_index - i) % ctx->targets, G2V_FALSE)) {
+            break;
+        }
+    }
+}
+
+void g2v_render_default_options(g2v_render_options* opts, int width, int height) {
+    memset(opts, 0, sizeof *opts);
+    opts->width = width;
+    opts->height = height;
+    opts->targets = G2V_TARGETS;
+}
+
+int g2v_init_render_ctx(g2v_render_ctx* ctx, int width, int height) {
+    g2v_render_options opts;
+    g2v_render_default_options(&opts, width, height);
+    return g2v_init_render_ctx_ex(ctx, &opts);
+}
+
+/**
+ * Choose the tile size: the requested one, or else the largest one the OpenGL implementation supports.
+ */
+int init_tiles(g2v_render_ctx* ctx, const g2v_render_options* opts) {
+    GLint max_size, max_viewport[2];
+#ifdef G2V_TARGET_RENDERBUFFER
+    glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+#else
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+#endif
+    glGetIntegerv(GL_MAX_VIEWPORT_DIMS, max_viewport);
+    int max_width = max_size < max_viewport[0] ? max_size : max_viewport[0];
+    int max_height = max_size < max_viewport[1] ? max_size : max_viewport[1];
+
+    ctx->tile_width = opts->tile_width > 0 && opts->tile_width < ctx->width ? opts->tile_width : ctx->width;
+    ctx->tile_height = opts->tile_height > 0 && opts->tile_height < ctx->height ? opts->tile_height : ctx->height;
+    ctx->tile_width = ctx->tile_width > max_width ? max_width : ctx->tile_width;
+    ctx->tile_height = ctx->tile_height > max_height ? max_height : ctx->tile_height;
+    ctx->tiles_x = (ctx->width + ctx->tile_width - 1) / ctx->tile_width;
+    ctx->tiles_y = (ctx->height + ctx->tile_height - 1) / ctx->tile_height;
+    ctx->tile_index = 0;
+    ctx->tile = (g2v_rect) { 0, 0, ctx->tile_width, ctx->tile_height };
+    ctx->submitted_tiles = 0;
+    ctx->pending_tiles = 0;
+
+    ctx->render_width = opts->render_width > 0 ? opts->render_width : ctx->width;
+    ctx->render_height = opts->render_height > 0 ? opts->render_height : ctx->height;
+    if(ctx->render_width < ctx->width || ctx->render_height < ctx->height) {
+        err_printf("Render resolution %dx%d is smaller than the video", ctx->render_width, ctx->render_height);
+        return G2V_FALSE;
+    }
+    if(is_supersampled(ctx) && (ctx->render_width > max_width || ctx->render_height > max_height || ctx->tiles_x * ctx->tiles_y > 1)) {
+        err_printf("Supersampling at %dx%d can't be combined with tiling", ctx->render_width, ctx->render_height);
+        return G2V_FALSE;
+    }
+    ctx->accumulate = opts->accumulate > 1 ? opts->accumulate : 1;
+    ctx->accumulate_index = 0;
+    if(ctx->accumulate > 1 && ctx->tiles_x * ctx->tiles_y > 1) {
+        err_printf("Accumulation of %d sub-frames can't be combined with tiling", ctx->accumulate);
+        return G2V_FALSE;
+    }
+
+    if(opts->effect_count > 0 && (ctx->tiles_x * ctx->tiles_y > 1 || opts->track_damage)) {
+        err_printf("Post-process effects can't be combined with tiling or track_damage");
+        return G2V_FALSE;
+    }
+
+    //Damage rectangles are reported in video pixels, which don't map onto the supersampled image
+    if(is_supersampled(ctx) && opts->track_damage) {
+        err_printf("Supersampling can't be combined with track_damage");
+        return G2V_FALSE;
+    }
+
+    if(ctx->tiles_x * ctx->tiles_y > 1 && (opts->detect_flat || opts->detect_duplicates || opts->track_damage)) {
+        err_printf("Tiled rendering (%dx%d tiles) can't be combined with detect_flat, detect_duplicates or track_damage", ctx->tile_width, ctx->tile_height);
+        return G2V_FALSE;
+    }
+
+    //The planes target only holds the last frame, and the planes can't be patched with damage
+    ctx->pixel_format = opts->pixel_format;
+    if(ctx->pixel_format == G2V_PIXELS_GBRP && (ctx->tiles_x * ctx->tiles_y > 1 || opts->detect_flat || opts->track_damage)) {
+        err_printf("Planar readback can't be combined with tiling, detect_flat or track_damage");
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+/**
+ * A single multisampled target is enough: it is resolved into the target of the frame before the next frame is rendered.
+ */
+int init_msaa(g2v_render_ctx* ctx, const g2v_render_options* opts) {
+    ctx->samples = 0;
+    ctx->msaa_framebuffer = ctx->msaa_renderbuffer = 0;
+    if(opts->samples <= 1) {
+        return G2V_TRUE;
+    }
+    GLint max_samples;
+    glGetIntegerv(GL_MAX_SAMPLES, &max_samples);
+    ctx->samples = opts->samples < max_samples ? opts->samples : max_samples;
+
+    glGenFramebuffers(1, &ctx->msaa_framebuffer);
+    glGenRenderbuffers(1, &ctx->msaa_renderbuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->msaa_framebuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, ctx->msaa_renderbuffer);
+    int width = is_supersampled(ctx) ? ctx->render_width : ctx->tile_width;
+    int height = is_supersampled(ctx) ? ctx->render_height : ctx->tile_height;
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, ctx->samples, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, ctx->msaa_renderbuffer);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        err_printf("Could not create multisampled framebuffer with %d samples", ctx->samples);
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+int g2v_init_render_ctx_ex(g2v_render_ctx* ctx, const g2v_render_options* opts) {
+    int width = opts->width, height = opts->height;
+    if(opts->targets < 2 || opts->targets > G2V_MAX_TARGETS) {
+        err_printf("Invalid number of render targets: %d", opts->targets);
+        return G2V_FALSE;
+    }
+    ctx->width = width;
+    ctx->height = height;
+    ctx->targets = opts->targets;
+    if(!init_tiles(ctx, opts)) {
+        return G2V_FALSE;
+    }
+    ctx->pix_data = g2v_alloc_buffer(sizeof(int) * width * height);
+    ctx->current_frame_index = 0;
+    ctx->pending_frames = 0;
+    ctx->pix_data_frame_index = -1;
+    ctx->pix_data_flat = G2V_FALSE;
+    ctx->pix_data_flat_color = 0;
+    ctx->detect_duplicates = opts->detect_duplicates;
+    ctx->pix_data_hash = 0;
+    ctx->pix_data_duplicate = G2V_FALSE;
+    memset(ctx->frame_unchanged, 0, sizeof ctx->frame_unchanged);
+    ctx->track_damage = opts->track_damage;
+    memset(ctx->damage_count, 0, sizeof ctx->damage_count);
+    ctx->pix_data_dirty_y0 = 0;
+    ctx->pix_data_dirty_y1 = height;
+    ctx->passes = NULL;
+    ctx->timings = alloc_timings();
+    if(!ctx->pix_data || !ctx->timings) {
+        err_printf("Could not allocate frame buffer");
+        g2v_free_buffer(ctx->pix_data, sizeof(int) * width * height);
+        free_timings(ctx->timings);
+        return G2V_FALSE;
+    }
+
+    memset(ctx->fences, 0, sizeof ctx->fences);
+    memset(ctx->timestamp_queries, 0, sizeof ctx->timestamp_queries);
+    if(GLAD_GL_ARB_timer_query) {
+        glGenQueries(ctx->targets * 3, &ctx->timestamp_queries[0][0]);
+    }
+
+    glGenFramebuffers(ctx->targets, ctx->framebuffers);
+    glGenBuffers(ctx->targets, ctx->pbos);
+#ifdef G2V_TARGET_RENDERBUFFER
+    glGenRenderbuffers(ctx->targets, ctx->renderbuffers);
+#else
+    glGenTextures(ctx->targets, ctx->textures);
+#endif
+
+    for(int i = 0; i < ctx->targets; i++) {
+        glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffers[i]);
+#ifdef G2V_TARGET_RENDERBUFFER
+        glBindRenderbuffer(GL_RENDERBUFFER, ctx->renderbuffers[i]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, ctx->tile_width, ctx->tile_height);
+        glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, ctx->renderbuffers[i]);
+#else
+        glBindTexture(GL_TEXTURE_2D, ctx->textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, ctx->tile_width, ctx->tile_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->textures[i], 0);
+#endif
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(int) * ctx->tile_width * ctx->tile_height, NULL, GL_STREAM_READ);
+
+        assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+    }
+
+    if(!init_msaa(ctx, opts) || !init_passes(ctx, opts)) {
+        g2v_free_render_ctx(ctx);
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+void g2v_free_render_ctx(g2v_render_ctx* ctx) {
+    g2v_free_buffer(ctx->pix_data, sizeof(int) * ctx->width * ctx->height);
+    free_timings(ctx->timings);
+    free_passes(ctx->passes);
+    ctx->passes = NULL;
+    if(ctx->timestamp_queries[0][0]) {
+        glDeleteQueries(ctx->targets * 3, &ctx->timestamp_queries[0][0]);
+    }
+    for(int i = 0; i < ctx->targets; i++) {
+        if(ctx->fences[i]) {
+            glDeleteSync(ctx->fences[i]);
+        }
+    }
+    glDeleteFramebuffers(ctx->targets, ctx->framebuffers);
+    glDeleteBuffers(ctx->targets, ctx->pbos);
+    if(ctx->samples) {
+        glDeleteFramebuffers(1, &ctx->msaa_framebuffer);
+        glDeleteRenderbuffers(1, &ctx->msaa_renderbuffer);
+    }
+#ifdef G2V_TARGET_RENDERBUFFER
+    glDeleteRenderbuffers(ctx->targets, ctx->renderbuffers);
+#else
+    glDeleteTextures(ctx->targets, ctx->textures);
+#endif
+}
+
+//Framebuffer the frame (or tile) of target idx is rendered into
+GLuint render_framebuffer(g2v_render_ctx* ctx, int idx) {
+    if(ctx->samples) {
+        return ctx->msaa_framebuffer;
+    }
+    return has_scene(ctx) ? ctx->passes->scene_framebuffer : ctx->framebuffers[idx];
+}
+
+void prepare_gl_state(g2v_render_ctx* ctx) {
+    glBindFramebuffer(GL_FRAMEBUFFER, render_framebuffer(ctx, ctx->current_frame_index % ctx->targets));
+    glViewport(0, 0, ctx->render_width, ctx->render_height);
+}
+
+/**
+ * Resolve the multisampled framebuffer into target idx, and leave that target bound for the readback.
+ * The resolve can't also flip the image: multisampled blits require identical source and destination rectangles.
+ */
+void resolve_msaa(g2v_render_ctx* ctx, int idx, int width, int height) {
+    if(!ctx->samples) {
+        return;
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->msaa_framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, has_scene(ctx) ? ctx->passes->scene_framebuffer : ctx->framebuffers[idx]);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffers[idx]);
+}
+
+/**
+ * Turn what was rendered into the final image in target idx (MSAA resolve, supersampling downscale, accumulation, effects),
+ * and leave that target bound for the readback.
+ */
+void finish_frame(g2v_render_ctx* ctx, int idx, int width, int height) {
+    resolve_msaa(ctx, idx, width, height);
+    if(has_scene(ctx)) {
+        resolve_scene(ctx, idx);
+    }
+    if(ctx->passes && ctx->passes->effect_count > 0) {
+        apply_effects(ctx, idx);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffers[idx]);
+}
+
+void g2v_flip_rows(int* dst, const int* src, int width, int height) {
+    int* row = dst + width * (height - 1);
+    for(int y = 0; y < height; y++) {
+        memcpy(row, src, width * sizeof(int));
+        row -= width;
+        src += width;
+    }
+}
+
+/*
+    Frame hash: the accumulate loop of XXH3 (64-bit lanes fed by 32x32->64 bit multiplies, which compilers vectorize
+    with SSE2/AVX2/NEON), with its own constants and a simplified finalization. Not compatible with XXH3 outputs.
+*/
+
+#define HASH_LANES 8
+#define HASH_STRIPE (HASH_LANES * 8)
+#define HASH_STRIPES_PER_BLOCK 16
+#define HASH_PRIME32_1 0x9E3779B1U
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+const uint64_t hash_secret[HASH_LANES] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+void hash_stripe(uint64_t* acc, const unsigned char* p) {
+    for(int lane = 0; lane < HASH_LANES; lane++) {
+        uint64_t data;
+        memcpy(&data, p + lane * 8, 8);
+        uint64_t key = data ^ hash_secret[lane];
+        acc[lane ^ 1] += data;
+        acc[lane] += (key & 0xffffffff) * (key >> 32);
+    }
+}
+
+//Mixes the high bits back in, otherwise they would never influence the multiplies
+void hash_scramble(uint64_t* acc) {
+    for(int lane = 0; lane < HASH_LANES; lane++) {
+        uint64_t a = acc[lane];
+        a ^= a >> 47;
+        a ^= hash_secret[HASH_LANES - 1 - lane];
+        acc[lane] = a * HASH_PRIME32_1;
+    }
+}
+
+uint64_t hash_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= HASH_PRIME64_2;
+    h ^= h >> 29;
+    h *= HASH_PRIME64_1;
+    h ^= h >> 32;
+    return h;
+}
+
+unsigned long long g2v_hash_frame(const void* data, size_t size) {
+    const unsigned char* p = data;
+    uint64_t acc[HASH_LANES] = {
+        HASH_PRIME32_1, HASH_PRIME64_1, HASH_PRIME64_2, ~HASH_PRIME64_1,
+        ~HASH_PRIME64_2, ~(uint64_t)HASH_PRIME32_1, HASH_PRIME64_1 ^ HASH_PRIME64_2, size,
+    };
+    size_t stripes = size / HASH_STRIPE;
+    for(size_t i = 0; i < stripes; i++) {
+        hash_stripe(acc, p + i * HASH_STRIPE);
+        if(i % HASH_STRIPES_PER_BLOCK == HASH_STRIPES_PER_BLOCK - 1) {
+            hash_scramble(acc);
+        }
+    }
+    size_t rest = size % HASH_STRIPE;
+    if(rest) {
+        unsigned char last[HASH_STRIPE] = { 0 };
+        memcpy(last, p + stripes * HASH_STRIPE, rest);
+        hash_stripe(acc, last);
+    }
+
+    uint64_t h = size * HASH_PRIME64_1;
+    for(int lane = 0; lane < HASH_LANES; lane++) {
+        h = (h ^ hash_avalanche(acc[lane] ^ hash_secret[lane])) * HASH_PRIME64_2;
+    }
+    //0 means "no hash" in g2v_render_ctx.pix_data_hash
+    h = hash_avalanche(h);
+    return h ? h : 1;
+}
+
+void record_gpu_stages(g2v_render_ctx* ctx, int idx) {
+    GLuint* queries = ctx->timestamp_queries[idx];
+    GLuint available = GL_FALSE;
+    if(!queries[0]) {
+        return;
+    }
+    //The readback of this target has completed, so the results are normally there, but never wait for them
+    glGetQueryObjectuiv(queries[2], GL_QUERY_RESULT_AVAILABLE, &available);
+    if(!available) {
+        return;
+    }
+    GLuint64 t[3];
+    for(int i = 0; i < 3; i++) {
+        glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &t[i]);
+    }
+    record_stage(ctx->timings, G2V_STAGE_GPU_RENDER, (t[1] - t[0]) * 1e-9);
+    record_stage(ctx->timings, G2V_STAGE_GPU_READBACK, (t[2] - t[1]) * 1e-9);
+
+    if(trace_enabled() && GLAD_GL_ARB_sync) {
+        if(tracer.gpu_offset == 0) {
+            GLint64 now;
+            glGetInteger64v(GL_TIMESTAMP, &now);
+            tracer.gpu_offset = now * 1e-9 - stage_clock();
+        }
+        trace_push("gpu_render", 'G', t[0] * 1e-9 - tracer.gpu_offset, t[1] * 1e-9 - tracer.gpu_offset, 0);
+        trace_push("gpu_readback", 'G', t[1] * 1e-9 - tracer.gpu_offset, t[2] * 1e-9 - tracer.gpu_offset, 0);
+    }
+}
+
+/**
+ * Copy the damaged rectangles of target idx from its PBO (laid out like a full frame) into pix_data, upside down,
+ * and set the dirty rows to the ones they cover.
+ */
+void patch_damage(g2v_render_ctx* ctx, int idx, const int* buffer_content) {
+    int width = ctx->width, height = ctx->height;
+    ctx->pix_data_dirty_y0 = height;
+    ctx->pix_data_dirty_y1 = 0;
+    for(int i = 0; i < ctx->damage_count[idx]; i++) {
+        const g2v_rect* r = &ctx->damage[idx][i];
+        for(int y = r->y; y < r->y + r->height; y++) {
+            memcpy(ctx->pix_data + (size_t)(height - 1 - y) * width + r->x, buffer_content + (size_t)y * width + r->x, r->width * sizeof(int));
+        }
+        int top = height - (r->y + r->height), bottom = height - r->y;
+        ctx->pix_data_dirty_y0 = top < ctx->pix_data_dirty_y0 ? top : ctx->pix_data_dirty_y0;
+        ctx->pix_data_dirty_y1 = bottom > ctx->pix_data_dirty_y1 ? bottom : ctx->pix_data_dirty_y1;
+    }
+}
+
+//Bytes of a frame in pix_data
+size_t frame_bytes(const g2v_render_ctx* ctx) {
+    size_t pixels = (size_t)ctx->width * ctx->height;
+    return ctx->pixel_format == G2V_PIXELS_GBRP ? 3 * pixels : sizeof(int) * pixels;
+}
+
+void map_gl_data(g2v_render_ctx* ctx) {
+    int frame_index = ctx->current_frame_index - ctx->pending_frames;
+    int idx = frame_index % ctx->targets;
+    double start = stage_clock();
+    //Flatness of the previous frame, pix_data_flat is overwritten below
+    int previous_flat = ctx->pix_data_flat, previous_color = ctx->pix_data_flat_color;
+
+    if(ctx->frame_unchanged[idx]) {
+        //Nothing was read back, pix_data and the flat/hash state still describe the previous frame
+        ctx->pix_data_duplicate = G2V_TRUE;
+        ctx->pix_data_dirty_y0 = ctx->pix_data_dirty_y1 = 0;
+        ctx->timings->duplicate_frames++;
+        trace_counter("duplicate_frames", ctx->timings->duplicate_frames);
+        ctx->pix_data_frame_index = frame_index;
+        ctx->pending_frames--;
+        trace_counter("pending_frames", ctx->pending_frames);
+        return;
+    }
+
+    resolve_flat_check(ctx, idx, G2V_TRUE);
+    if(ctx->passes && ctx->passes->slot_state[idx] == SLOT_FLAT) {
+        //Nothing else was read back, the encoder fills the frame with this colour
+        ctx->pix_data_flat = G2V_TRUE;
+        ctx->pix_data_flat_color = ctx->passes->flat_colors[idx];
+        ctx->pix_data_duplicate = ctx->detect_duplicates && frame_index > 0 && previous_flat && previous_color == ctx->pix_data_flat_color;
+        ctx->pix_data_dirty_y0 = 0;
+        ctx->pix_data_dirty_y1 = ctx->height;
+        ctx->timings->flat_frames++;
+        record_stage(ctx->timings, G2V_STAGE_MAP_WAIT, stage_clock() - start);
+        trace_counter("flat_frames", ctx->timings->flat_frames);
+    } else {
+        if(ctx->fences[idx]) {
+            while(glClientWaitSync(ctx->fences[idx], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+            glDeleteSync(ctx->fences[idx]);
+            ctx->fences[idx] = NULL;
+        }
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+        int* buffer_content = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        double mapped = stage_clock();
+        record_stage(ctx->timings, G2V_STAGE_MAP_WAIT, mapped - start);
+        trace_span("map", start, mapped);
+
+        if(ctx->damage_count[idx] > 0) {
+            //pix_data doesn't hold the previous frame if it was flat, but its colour is known
+            if(previous_flat) {
+                size_t pixels = (size_t)ctx->width * ctx->height;
+                for(size_t i = 0; i < pixels; i++) {
+                    ctx->pix_data[i] = previous_color;
+                }
+            }
+            patch_damage(ctx, idx, buffer_content);
+            ctx->pix_data_hash = 0;
+            ctx->pix_data_duplicate = G2V_FALSE;
+            ctx->timings->partial_frames++;
+        } else {
+            //A frame identical to the previous one is a duplicate, and encoders don't read pix_data for it, so the flip can be skipped.
+            //After a flat frame it isn't a duplicate, and pix_data may not hold it (e.g. tee and ladder encoders swap buffers)
+            int unchanged = G2V_FALSE;
+            if(ctx->detect_duplicates) {
+                unsigned long long hash = g2v_hash_frame(buffer_content, frame_bytes(ctx));
+                unchanged = hash == ctx->pix_data_hash;
+                ctx->pix_data_hash = hash;
+                trace_span("hash", mapped, stage_clock());
+            }
+            ctx->pix_data_duplicate = unchanged && !previous_flat;
+            ctx->pix_data_dirty_y0 = 0;
+            ctx->pix_data_dirty_y1 = ctx->height;
+
+            if(!ctx->pix_data_duplicate && ctx->pixel_format == G2V_PIXELS_GBRP) {
+                //The planes were already flipped on the GPU
+                memcpy(ctx->pix_data, buffer_content, frame_bytes(ctx));
+            } else if(!ctx->pix_data_duplicate) {
+                //Since glReadPixels returns pixel values upside down, we have to preprocess them
+                g2v_flip_rows(ctx->pix_data, buffer_content, ctx->width, ctx->height);
+            }
+        }
+        ctx->pix_data_flat = G2V_FALSE;
+
+        double flipped = stage_clock();
+        record_stage(ctx->timings, G2V_STAGE_FLIP, flipped - mapped);
+        trace_span("flip", mapped, flipped);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    if(ctx->pix_data_duplicate) {
+        ctx->timings->duplicate_frames++;
+        trace_counter("duplicate_frames", ctx->timings->duplicate_frames);
+    }
+    record_gpu_stages(ctx, idx);
+
+    ctx->pix_data_frame_index = frame_index;
+    ctx->pending_frames--;
+    trace_counter("pending_frames", ctx->pending_frames);
+}
+
+/**
+ * Queue the asynchronous readback of the current frame into its PBO.
+ */
+void read_gl_data(g2v_render_ctx* ctx) {
+    int idx = ctx->current_frame_index % ctx->targets;
+    double start = stage_clock();
+
+    if(ctx->frame_unchanged[idx]) {
+        if(ctx->passes) {
+            ctx->passes->slot_state[idx] = SLOT_FULL;
+        }
+        ctx->current_frame_index++;
+        ctx->pending_frames++;
+        trace_counter("pending_frames", ctx->pending_frames);
+        return;
+    }
+
+    finish_frame(ctx, idx, ctx->render_width, ctx->render_height);
+    if(ctx->timestamp_queries[idx][1]) {
+        glQueryCounter(ctx->timestamp_queries[idx][1], GL_TIMESTAMP);
+    }
+    //Damage is relative to the previous frame, so the first frame is always read back in full
+    if(ctx->pending_frames == 0 && ctx->pix_data_frame_index < 0) {
+        ctx->damage_count[idx] = 0;
+    }
+    if(ctx->damage_count[idx] > 0) {
+        //Every rectangle lands where it would be in a full readback, so the PBO keeps the layout of a frame
+        if(ctx->passes) {
+            ctx->passes->slot_state[idx] = SLOT_FULL;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+        glPixelStorei(GL_PACK_ROW_LENGTH, ctx->width);
+        for(int i = 0; i < ctx->damage_count[idx]; i++) {
+            const g2v_rect* r = &ctx->damage[idx][i];
+            glReadPixels(r->x, r->y, r->width, r->height, GL_BGRA, GL_UNSIGNED_BYTE, (void*)(intptr_t)(sizeof(int) * ((size_t)r->y * ctx->width + r->x)));
+            ctx->timings->readback_bytes += sizeof(int) * r->width * r->height;
+        }
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    } else if(ctx->passes && ctx->passes->detect_flat) {
+        //The full readback is only queued by resolve_flat_check(), if the frame turns out not to be flat
+        detect_flat_frame(ctx, idx);
+    } else if(ctx->pixel_format == G2V_PIXELS_GBRP) {
+        read_planes(ctx, idx);
+    } else {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+        glReadPixels(0, 0, ctx->width, ctx->height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+        ctx->timings->readback_bytes += sizeof(int) * ctx->width * ctx->height;
+    }
+    if(ctx->timestamp_queries[idx][2]) {
+        glQueryCounter(ctx->timestamp_queries[idx][2], GL_TIMESTAMP);
+    }
+    if(GLAD_GL_ARB_sync) {
+        ctx->fences[idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        //Make sure the fence reaches the GPU, otherwise polling it would never succeed
+        glFlush();
+    }
+
+    ctx->current_frame_index++;
+    ctx->pending_frames++;
+    trace_span("readback", start, stage_clock());
+    trace_counter("pending_frames", ctx->pending_frames);
+}
+
+/**
+ * Check whether the readback of the oldest pending frame has completed. Without fences, this can't be known
+ * and frames are only written once all PBOs are in flight.
+ */
+int oldest_frame_ready(g2v_render_ctx* ctx) {
+    if(ctx->pending_frames == 0) {
+        return G2V_FALSE;
+    }
+    int idx = (ctx->current_frame_index - ctx->pending_frames) % ctx->targets;
+    if(ctx->frame_unchanged[idx]) {
+        return G2V_TRUE;
+    }
+    if(!resolve_flat_check(ctx, idx, G2V_FALSE)) {
+        return G2V_FALSE;
+    }
+    if(ctx->passes && ctx->passes->slot_state[idx] == SLOT_FLAT) {
+        return G2V_TRUE;
+    }
+    GLsync fence = ctx->fences[idx];
+    if(!fence) {
+        return G2V_FALSE;
+    }
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+int write_oldest_frame(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    map_gl_data(ctx);
+    if(encoder->write_frame_fn) {
+        return encoder->write_frame_fn(ctx, encoder);
+    }
+    return G2V_TRUE;
+}
+
+/*
+    Tiled mode: the pipeline works on tiles instead of frames, every target holds one tile and frames are written to the encoder
+    once their last tile has been copied into pix_data
+*/
+
+int is_tiled(const g2v_render_ctx* ctx) {
+    return ctx->tiles_x * ctx->tiles_y > 1;
+}
+
+//Tiles go left to right, bottom to top, and the last ones of every row/column are cropped to the frame
+void tile_rect(const g2v_render_ctx* ctx, int tile_index, g2v_rect* tile) {
+    tile->x = tile_index % ctx->tiles_x * ctx->tile_width;
+    tile->y = tile_index / ctx->tiles_x * ctx->tile_height;
+    tile->width = ctx->width - tile->x < ctx->tile_width ? ctx->width - tile->x : ctx->tile_width;
+    tile->height = ctx->height - tile->y < ctx->tile_height ? ctx->height - tile->y : ctx->tile_height;
+}
+
+/**
+ * Map the oldest pending tile and copy it into pix_data. The frame is written to the encoder once its last tile is copied.
+ */
+int write_oldest_tile(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    int idx = (ctx->submitted_tiles - ctx->pending_tiles) % ctx->targets;
+    g2v_rect tile;
+    tile_rect(ctx, ctx->target_tile[idx], &tile);
+    double start = stage_clock();
+
+    if(ctx->fences[idx]) {
+        while(glClientWaitSync(ctx->fences[idx], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(ctx->fences[idx]);
+        ctx->fences[idx] = NULL;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+    const int* buffer_content = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    double mapped = stage_clock();
+    record_stage(ctx->timings, G2V_STAGE_MAP_WAIT, mapped - start);
+    trace_span("map", start, mapped);
+
+    //Stitch the tile into the frame, upside down like a whole frame
+    for(int y = 0; y < tile.height; y++) {
+        memcpy(ctx->pix_data + (size_t)(ctx->height - 1 - tile.y - y) * ctx->width + tile.x, buffer_content + (size_t)y * tile.width, tile.width * sizeof(int));
+    }
+    double flipped = stage_clock();
+    record_stage(ctx->timings, G2V_STAGE_FLIP, flipped - mapped);
+    trace_span("flip", mapped, flipped);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    ctx->pending_tiles--;
+
+    //Tiles of a frame which was never submitted (render_video_frame returned EOF halfway) are dropped
+    if(ctx->target_tile[idx] < ctx->tiles_x * ctx->tiles_y - 1 || ctx->target_frame[idx] >= ctx->current_frame_index) {
+        return G2V_TRUE;
+    }
+    ctx->pix_data_frame_index = ctx->target_frame[idx];
+    ctx->pending_frames--;
+    trace_counter("pending_frames", ctx->pending_frames);
+    if(encoder->write_frame_fn) {
+        return encoder->write_frame_fn(ctx, encoder);
+    }
+    return G2V_TRUE;
+}
+
+int oldest_tile_ready(g2v_render_ctx* ctx) {
+    if(ctx->pending_tiles == 0) {
+        return G2V_FALSE;
+    }
+    GLsync fence = ctx->fences[(ctx->submitted_tiles - ctx->pending_tiles) % ctx->targets];
+    if(!fence) {
+        return G2V_FALSE;
+    }
+    GLenum status = glClientWaitSync(fence, 0, 0);
+    return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+}
+
+//Bind the target of the tile tile_index, once it is free
+int begin_tile(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    if(ctx->pending_tiles == ctx->targets && !write_oldest_tile(encoder, ctx)) {
+        return G2V_FALSE;
+    }
+    tile_rect(ctx, ctx->tile_index, &ctx->tile);
+    glBindFramebuffer(GL_FRAMEBUFFER, render_framebuffer(ctx, ctx->submitted_tiles % ctx->targets));
+    glViewport(0, 0, ctx->tile.width, ctx->tile.height);
+    return G2V_TRUE;
+}
+
+void submit_tile(g2v_render_ctx* ctx) {
+    int idx = ctx->submitted_tiles % ctx->targets;
+    finish_frame(ctx, idx, ctx->tile.width, ctx->tile.height);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ctx->pbos[idx]);
+    glReadPixels(0, 0, ctx->tile.width, ctx->tile.height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+    ctx->timings->readback_bytes += sizeof(int) * ctx->tile.width * ctx->tile.height;
+    if(GLAD_GL_ARB_sync) {
+        ctx->fences[idx] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+    }
+    ctx->target_frame[idx] = ctx->current_frame_index;
+    ctx->target_tile[idx] = ctx->tile_index;
+    ctx->submitted_tiles++;
+    ctx->pending_tiles++;
+}
+
+int g2v_next_tile(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    if(!is_tiled(ctx) || ctx->tile_index == ctx->tiles_x * ctx->tiles_y - 1) {
+        return 0;
+    }
+    submit_tile(ctx);
+    ctx->tile_index++;
+    return begin_tile(encoder, ctx) ? 1 : -1;
+}
+
+void g2v_get_tile_matrix(const g2v_render_ctx* ctx, float matrix[16]) {
+    const g2v_rect* tile = &ctx->tile;
+    memset(matrix, 0, 16 * sizeof(float));
+    matrix[0] = (float)ctx->width / tile->width;
+    matrix[5] = (float)ctx->height / tile->height;
+    matrix[10] = 1.0f;
+    matrix[12] = (float)(ctx->width - 2 * tile->x) / tile->width - 1.0f;
+    matrix[13] = (float)(ctx->height - 2 * tile->y) / tile->height - 1.0f;
+    matrix[15] = 1.0f;
+}
+
+int g2v_next_subframe(g2v_render_ctx* ctx) {
+    if(ctx->accumulate_index >= ctx->accumulate - 1) {
+        return 0;
+    }
+    int idx = ctx->current_frame_index % ctx->targets;
+    //Nothing to accumulate for a frame which won't be read back
+    if(!ctx->frame_unchanged[idx]) {
+        resolve_msaa(ctx, idx, ctx->render_width, ctx->render_height);
+        resolve_scene(ctx, idx);
+    }
+    ctx->accumulate_index++;
+    prepare_gl_state(ctx);
+    return 1;
+}
+
+double g2v_get_subframe_offset(const g2v_render_ctx* ctx) {
+    return (double)ctx->accumulate_index / ctx->accumulate;
+}
+
+//Calls render_video_frame for every tile or sub-frame of the frame, returns its last result (or -1 if failed)
+int render_whole_frame(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    int eof, more = 0;
+    while(!(eof = encoder->render_video_frame(ctx, encoder->user_ptr))
+        && (more = is_tiled(ctx) ? g2v_next_tile(encoder, ctx) : g2v_next_subframe(ctx)) > 0);
+    return more < 0 ? -1 : eof;
+}
+
+int g2v_begin_frame(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    if(is_tiled(ctx)) {
+        ctx->tile_index = 0;
+        if(!begin_tile(encoder, ctx)) {
+            return G2V_FALSE;
+        }
+        ctx->timings->render_start = stage_clock();
+        return G2V_TRUE;
+    }
+    resolve_flat_checks(ctx);
+    if(ctx->pending_frames == ctx->targets && !write_oldest_frame(encoder, ctx)) {
+        return G2V_FALSE;
+    }
+    ctx->frame_unchanged[ctx->current_frame_index % ctx->targets] = G2V_FALSE;
+    ctx->damage_count[ctx->current_frame_index % ctx->targets] = 0;
+    ctx->accumulate_index = 0;
+    prepare_gl_state(ctx);
+    GLuint render_query = ctx->timestamp_queries[ctx->current_frame_index % ctx->targets][0];
+    if(render_query) {
+        glQueryCounter(render_query, GL_TIMESTAMP);
+    }
+    ctx->timings->render_start = stage_clock();
+    return G2V_TRUE;
+}
+
+int g2v_submit_frame(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    double now = stage_clock();
+    record_stage(ctx->timings, G2V_STAGE_RENDER, now - ctx->timings->render_start);
+    trace_span("render", ctx->timings->render_start, now);
+    if(is_tiled(ctx)) {
+        //A frame whose tiles weren't all rendered (render_video_frame returned EOF halfway) is dropped
+        if(ctx->tile_index != ctx->tiles_x * ctx->tiles_y - 1) {
+            return G2V_TRUE;
+        }
+        submit_tile(ctx);
+        ctx->current_frame_index++;
+        ctx->pending_frames++;
+        trace_counter("pending_frames", ctx->pending_frames);
+        return G2V_TRUE;
+    }
+    read_gl_data(ctx);
+    if(encoder->submit_frame_fn) {
+        return encoder->submit_frame_fn(ctx, encoder);
+    }
+    return G2V_TRUE;
+}
+
+void g2v_mark_frame_unchanged(g2v_render_ctx* ctx) {
+    //The first frame has nothing to repeat
+    if(!is_tiled(ctx) && (ctx->pending_frames > 0 || ctx->pix_data_frame_index >= 0)) {
+        ctx->frame_unchanged[ctx->current_frame_index % ctx->targets] = G2V_TRUE;
+    }
+}
+
+void g2v_add_damage(g2v_render_ctx* ctx, int x, int y, int width, int height) {
+    int idx = ctx->current_frame_index % ctx->targets;
+    if(!ctx->track_damage || ctx->damage_count[idx] < 0) {
+        return;
+    }
+    int x1 = x + width, y1 = y + height;
+    x = x < 0 ? 0 : x;
+    y = y < 0 ? 0 : y;
+    x1 = x1 > ctx->width ? ctx->width : x1;
+    y1 = y1 > ctx->height ? ctx->height : y1;
+    if(x1 <= x || y1 <= y) {
+        return;
+    }
+    if(ctx->damage_count[idx] == G2V_MAX_DAMAGE_RECTS) {
+        //Too many rectangles, read back the whole frame
+        ctx->damage_count[idx] = -1;
+        return;
+    }
+    ctx->damage[idx][ctx->damage_count[idx]++] = (g2v_rect) { x, y, x1 - x, y1 - y };
+}
+
+int g2v_poll(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    int written = 0;
+    if(is_tiled(ctx)) {
+        while(oldest_tile_ready(ctx)) {
+            int pending = ctx->pending_frames;
+            if(!write_oldest_tile(encoder, ctx)) {
+                return -1;
+            }
+            written += pending - ctx->pending_frames;
+        }
+        return written;
+    }
+    resolve_flat_checks(ctx);
+    while(oldest_frame_ready(ctx)) {
+        if(!write_oldest_frame(encoder, ctx)) {
+            return -1;
+        }
+        written++;
+    }
+    return written;
+}
+
+int g2v_end_frames(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    while(ctx->pending_tiles > 0) {
+        if(!write_oldest_tile(encoder, ctx)) {
+            return G2V_FALSE;
+        }
+    }
+    //Tiled frames are only written by their last tile, never read back whole
+    while(!is_tiled(ctx) && ctx->pending_frames > 0) {
+        if(!write_oldest_frame(encoder, ctx)) {
+            return G2V_FALSE;
+        }
+    }
+    if(encoder->end_fn) {
+        return encoder->end_fn(ctx, encoder);
+    }
+    return G2V_TRUE;
+}
+
+int g2v_encode(g2v_encoder* encoder, g2v_render_ctx* ctx) {
+    return encoder->encode_fn(ctx, encoder);
+}
+
+//Renders and writes frames until render_video_frame returns EOF, used by encoders which only provide a write function
+int pipeline_encode(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    for(;;) {
+        if(!g2v_begin_frame(encoder, ctx)) {
+            return G2V_FALSE;
+        }
+        int eof = render_whole_frame(encoder, ctx);
+        if(eof < 0) {
+            return G2V_FALSE;
+        } else if(eof) {
+            return g2v_end_frames(encoder, ctx);
+        } else if(!g2v_submit_frame(encoder, ctx) || g2v_poll(encoder, ctx) < 0) {
+            return G2V_FALSE;
+        }
+    }
+}
+
+int glfw_encode(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    while(!glfwWindowShouldClose(g2v.window)) {
+        glfwPollEvents();
+
+        if(!g2v_begin_frame(encoder, ctx)) {
+            return G2V_FALSE;
+        }
+        int eof = render_whole_frame(encoder, ctx);
+        if(eof < 0) {
+            return G2V_FALSE;
+        }
+        //The last frame is still shown, unless only part of its tiles were rendered
+        if(!eof || !is_tiled(ctx)) {
+            g2v_submit_frame(encoder, ctx);
+        }
+        glfwSwapBuffers(g2v.window);
+        if(eof) {
+            break;
+        }
+    }
+    return g2v_end_frames(encoder, ctx);
+}
+
+int g2v_create_glfw_encoder(g2v_encoder* enc, g2v_render_ctx* ctx) {
+    glfwShowWindow(g2v.window);
+    enc->encode_fn = glfw_encode;
+    enc->write_frame_fn = NULL;
+    enc->submit_frame_fn = NULL;
+    enc->end_fn = NULL;
+    return G2V_TRUE;
+}
+
+int g2v_finish_glfw_encoder(g2v_encoder* enc) {
+    glfwHideWindow(g2v.window);
+    return G2V_TRUE;
+}
+
+char* copy_string(const char* str) {
+    char* copy = g2v_malloc(strlen(str) + 1);
+    strcpy(copy, str);
+    return copy;
+}
+
+/*
+    Live preview, shown by the encoders from their submit function
+*/
+
+typedef struct {
+    int enabled;
+    int every_frames;
+    double min_interval, last_time;
+} preview_state;
+
+void init_preview(preview_state* preview, const g2v_preview_options* opts) {
+    memset(preview, 0, sizeof *preview);
+    if(!opts) {
+        return;
+    }
+    preview->enabled = G2V_TRUE;
+    preview->every_frames = opts->every_frames > 1 ? opts->every_frames : 1;
+    preview->min_interval = opts->max_fps > 0 ? 1.0 / opts->max_fps : 0;
+    preview->last_time = -preview->min_interval;
+    //Presenting never waits for vsync, so it can't throttle the encoding
+    glfwSwapInterval(0);
+    glfwShowWindow(g2v.window);
+}
+
+void finish_preview(preview_state* preview) {
+    if(preview->enabled) {
+        glfwHideWindow(g2v.window);
+    }
+}
+
+//Blit the frame just submitted to the gl2vid window, if it is due
+void show_preview(g2v_render_ctx* ctx, preview_state* preview) {
+    int frame_index = ctx->current_frame_index - 1;
+    int idx = frame_index % ctx->targets;
+    //Unchanged frames were not rendered, the window already shows the same image
+    if(!preview->enabled || frame_index % preview->every_frames != 0 || ctx->frame_unchanged[idx]) {
+        return;
+    }
+    double now = stage_clock();
+    if(now - preview->last_time < preview->min_interval) {
+        return;
+    }
+    preview->last_time = now;
+
+    int width, height;
+    glfwPollEvents();
+    glfwGetFramebufferSize(g2v.window, &width, &height);
+    pass_state saved;
+    begin_pass(&saved);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->framebuffers[idx]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, ctx->width, ctx->height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    end_pass(&saved);
+    glfwSwapBuffers(g2v.window);
+    trace_span("preview", now, stage_clock());
+}
+
+/*
+    Raw and hash encoders. Flat frames have no pixels in pix_data, and duplicates repeat the previous frame,
+    which may have been flat too.
+*/
+
+typedef struct {
+    FILE* output;
+    int width, height;
+    //Flatness of the last frame written
+    int flat, flat_color;
+    //One row (raw) or one frame (hash) filled with flat_color
+    int* fill;
+    size_t fill_size;
+    unsigned long long hash;
+} raw_internals;
+
+raw_internals* create_raw_internals(g2v_render_ctx* ctx, FILE* output, size_t fill_size) {
+    if(ctx->pixel_format != G2V_PIXELS_BGRA) {
+        err_printf("Raw and hash encoders need BGRA pixels");
+        return NULL;
+    }
+    raw_internals* ri = g2v_calloc(1, sizeof *ri);
+    if(!ri) {
+        err_printf("Could not allocate encoder");
+        return NULL;
+    }
+    ri->output = output;
+    ri->width = ctx->width;
+    ri->height = ctx->height;
+    ri->fill_size = fill_size;
+    ri->fill = g2v_alloc_buffer(fill_size);
+    if(!ri->fill) {
+        err_printf("Could not allocate encoder");
+        g2v_free(ri);
+        return NULL;
+    }
+    return ri;
+}
+
+void free_raw_internals(raw_internals* ri) {
+    g2v_free_buffer(ri->fill, ri->fill_size);
+    g2v_free(ri);
+}
+
+//Update the flatness of the last frame, returns G2V_TRUE if the frame is flat (and fill_count ints of fill hold its colour)
+int raw_frame_flat(raw_internals* ri, g2v_render_ctx* ctx, size_t fill_count) {
+    if(ctx->pix_data_flat || (ctx->pix_data_duplicate && ri->flat)) {
+        int color = ctx->pix_data_flat ? ctx->pix_data_flat_color : ri->flat_color;
+        if(!ri->flat || color != ri->flat_color) {
+            for(size_t i = 0; i < fill_count; i++) {
+                ri->fill[i] = color;
+            }
+        }
+        ri->flat = G2V_TRUE;
+        ri->flat_color = color;
+        return G2V_TRUE;
+    }
+    ri->flat = G2V_FALSE;
+    return G2V_FALSE;
+}
+
+int raw_write_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    raw_internals* ri = encoder->internal_data;
+    size_t written, expected;
+    if(raw_frame_flat(ri, ctx, ri->width)) {
+        written = 0;
+        for(int y = 0; y < ri->height; y++) {
+            written += fwrite(ri->fill, sizeof(int), ri->width, ri->output);
+        }
+    } else {
+        written = fwrite(ctx->pix_data, sizeof(int), (size_t)ri->width * ri->height, ri->output);
+    }
+    expected = (size_t)ri->width * ri->height;
+    if(written != expected) {
+        err_printf("Could not write raw frame %d", ctx->pix_data_frame_index);
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+int raw_end(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    (void)ctx;
+    raw_internals* ri = encoder->internal_data;
+    return fflush(ri->output) == 0;
+}
+
+int g2v_create_raw_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, FILE* output) {
+    raw_internals* ri = create_raw_internals(ctx, output, sizeof(int) * ctx->width);
+    if(!ri) {
+        return G2V_FALSE;
+    }
+    enc->internal_data = ri;
+    enc->encode_fn = pipeline_encode;
+    enc->write_frame_fn = raw_write_frame;
+    enc->submit_frame_fn = NULL;
+    enc->end_fn = raw_end;
+    return G2V_TRUE;
+}
+
+int g2v_finish_raw_encoder(g2v_encoder* enc) {
+    free_raw_internals(enc->internal_data);
+    enc->internal_data = NULL;
+    return G2V_TRUE;
+}
+
+int hash_write_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    raw_internals* ri = encoder->internal_data;
+    size_t size = sizeof(int) * ri->width * ri->height;
+    int was_flat = ri->flat;
+    if(raw_frame_flat(ri, ctx, (size_t)ri->width * ri->height)) {
+        if(!(ctx->pix_data_duplicate && was_flat)) {
+            ri->hash = g2v_hash_frame(ri->fill, size);
+        }
+    } else if(!ctx->pix_data_duplicate) {
+        ri->hash = g2v_hash_frame(ctx->pix_data, size);
+    }
+    if(fprintf(ri->output, "%d %016llx\n", ctx->pix_data_frame_index, ri->hash) < 0) {
+        err_printf("Could not write hash of frame %d", ctx->pix_data_frame_index);
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+int g2v_create_hash_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, FILE* output) {
+    raw_internals* ri = create_raw_internals(ctx, output, sizeof(int) * ctx->width * ctx->height);
+    if(!ri) {
+        return G2V_FALSE;
+    }
+    enc->internal_data = ri;
+    enc->encode_fn = pipeline_encode;
+    enc->write_frame_fn = hash_write_frame;
+    enc->submit_frame_fn = NULL;
+    enc->end_fn = raw_end;
+    return G2V_TRUE;
+}
+
+int g2v_finish_hash_encoder(g2v_encoder* enc) {
+    return g2v_finish_raw_encoder(enc);
+}
+
+/*
+    Thumbnail encoder: thumbnails are downscaled into the targets of their own small render context, whose pipeline
+    reads them back and hands them to a proxy encoder which packs them into the current sprite sheet.
+*/
+
+typedef struct {
+    g2v_render_ctx ctx;
+    g2v_encoder proxy;
+    int interval_frames, columns, rows, fps;
+    char* sheet_file;
+    char* vtt_file;
+    int* sheet;
+    size_t sheet_size;
+    //Number of thumbnails packed so far, and of frames of the video
+    int count, frames;
+    //Target of the last frame actually rendered (-1 if none), and whether it came after the last thumbnail
+    int rendered_idx, rendered_since_thumb;
+} thumbnail_internals;
+
+void put_le(unsigned char* dst, unsigned value, int bytes) {
+    for(int i = 0; i < bytes; i++) {
+        dst[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+//Write a 32 bit BMP, pixels rows from top to bottom (negative height)
+int write_bmp(const char* filename, const int* pixels, int width, int height) {
+    unsigned char header[54] = { 'B', 'M' };
+    unsigned size = (unsigned)(sizeof(int) * width * height);
+    put_le(header + 2, sizeof header + size, 4);
+    put_le(header + 10, sizeof header, 4);
+    put_le(header + 14, 40, 4);
+    put_le(header + 18, (unsigned)width, 4);
+    put_le(header + 22, (unsigned)-height, 4);
+    put_le(header + 26, 1, 2);
+    put_le(header + 28, 32, 2);
+    put_le(header + 34, size, 4);
+    FILE* f = fopen(filename, "wb");
+    if(!f) {
+        err_printf("Could not open %s", filename);
+        return G2V_FALSE;
+    }
+    int ok = fwrite(header, sizeof header, 1, f) == 1 && fwrite(pixels, size, 1, f) == 1;
+    if(fclose(f) != 0 || !ok) {
+        err_printf("Could not write %s", filename);
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+//Whether pattern is a safe printf format for a single int: exactly one %d (with an optional zero padded width), and %% otherwise
+int is_index_pattern(const char* pattern) {
+    int conversions = 0;
+    for(const char* c = pattern; *c; c++) {
+        if(*c != '%') {
+            continue;
+        }
+        if(c[1] == '%') {
+            c++;
+            continue;
+        }
+        c++;
+        while(*c >= '0' && *c <= '9') {
+            c++;
+        }
+        if(*c != 'd') {
+            return G2V_FALSE;
+        }
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+char* thumbnail_sheet_filename(thumbnail_internals* ti, int sheet) {
+    //The pattern can be padded to any width, see is_index_pattern()
+    size_t size = snprintf(NULL, 0, ti->sheet_file, sheet) + 1;
+    char* filename = g2v_malloc(size);
+    if(filename) {
+        snprintf(filename, size, ti->sheet_file, sheet);
+    }
+    return filename;
+}
+
+//Write the sheet holding the last thumbnail, cropped to the rows it uses
+int thumbnail_write_sheet(thumbnail_internals* ti) {
+    int per_sheet = ti->columns * ti->rows;
+    int sheet = (ti->count - 1) / per_sheet;
+    int rows = ((ti->count - 1) % per_sheet) / ti->columns + 1;
+    char* filename = thumbnail_sheet_filename(ti, sheet);
+    if(!filename) {
+        err_printf("Could not allocate filename");
+        return G2V_FALSE;
+    }
+    int ok = write_bmp(filename, ti->sheet, ti->columns * ti->ctx.width, rows * ti->ctx.height);
+    g2v_free(filename);
+    memset(ti->sheet, 0, ti->sheet_size);
+    return ok;
+}
+
+int thumbnail_write_thumb(g2v_render_ctx* ctx, g2v_encoder* proxy) {
+    thumbnail_internals* ti = proxy->internal_data;
+    int cell = ctx->pix_data_frame_index % (ti->columns * ti->rows);
+    int stride = ti->columns * ctx->width;
+    int* dst = ti->sheet + (size_t)(cell / ti->columns) * ctx->height * stride + (size_t)(cell % ti->columns) * ctx->width;
+    //Duplicates still hold the previous thumbnail in pix_data
+    for(int y = 0; y < ctx->height; y++) {
+        memcpy(dst + (size_t)y * stride, ctx->pix_data + (size_t)y * ctx->width, sizeof(int) * ctx->width);
+    }
+    ti->count = ctx->pix_data_frame_index + 1;
+    if(cell == ti->columns * ti->rows - 1) {
+        return thumbnail_write_sheet(ti);
+    }
+    return G2V_TRUE;
+}
+
+//Downscale the frame just submitted if a thumbnail is due, and queue its readback
+int thumbnail_submit_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    thumbnail_internals* ti = encoder->internal_data;
+    int frame_index = ctx->current_frame_index - 1;
+    int idx = frame_index % ctx->targets;
+    ti->frames = ctx->current_frame_index;
+    //Unchanged frames leave their target alone, the frame they repeat is still in the target it was rendered into
+    if(!ctx->frame_unchanged[idx]) {
+        ti->rendered_idx = idx;
+        ti->rendered_since_thumb = G2V_TRUE;
+    }
+    if(frame_index % ti->interval_frames != 0) {
+        return G2V_TRUE;
+    }
+    if(!g2v_begin_frame(&ti->proxy, &ti->ctx)) {
+        return G2V_FALSE;
+    }
+    if(!ti->rendered_since_thumb) {
+        g2v_mark_frame_unchanged(&ti->ctx);
+    } else {
+        g2v_render_ctx* dst = &ti->ctx;
+        downscale_target(ctx, ti->rendered_idx, &dst, 1);
+    }
+    ti->rendered_since_thumb = G2V_FALSE;
+    return g2v_submit_frame(&ti->proxy, &ti->ctx) && g2v_poll(&ti->proxy, &ti->ctx) >= 0;
+}
+
+void format_vtt_time(char* str, size_t size, double seconds) {
+    long long ms = (long long)(seconds * 1000 + 0.5);
+    snprintf(str, size, "%02lld:%02lld:%02lld.%03lld", ms / 3600000, ms / 60000 % 60, ms / 1000 % 60, ms % 1000);
+}
+
+int thumbnail_write_vtt(thumbnail_internals* ti) {
+    FILE* f = fopen(ti->vtt_file, "w");
+    if(!f) {
+        err_printf("Could not open %s", ti->vtt_file);
+        return G2V_FALSE;
+    }
+    int ok = fprintf(f, "WEBVTT\n") >= 0;
+    int per_sheet = ti->columns * ti->rows;
+    for(int i = 0; i < ti->count && ok; i++) {
+        char* filename = thumbnail_sheet_filename(ti, i / per_sheet);
+        if(!filename) {
+            ok = G2V_FALSE;
+            break;
+        }
+        //Sheets are referenced relative to the index
+        const char* name = filename;
+        for(const char* c = filename; *c; c++) {
+            if(*c == '/' || *c == '\\') {
+                name = c + 1;
+            }
+        }
+        int end_frame = (i + 1) * ti->interval_frames < ti->frames ? (i + 1) * ti->interval_frames : ti->frames;
+        char start[32], end[32];
+        format_vtt_time(start, sizeof start, (double)i * ti->interval_frames / ti->fps);
+        format_vtt_time(end, sizeof end, (double)end_frame / ti->fps);
+        int cell = i % per_sheet;
+        ok = fprintf(f, "\n%s --> %s\n%s#xywh=%d,%d,%d,%d\n", start, end, name,
+            cell % ti->columns * ti->ctx.width, cell / ti->columns * ti->ctx.height, ti->ctx.width, ti->ctx.height) >= 0;
+        g2v_free(filename);
+    }
+    if(fclose(f) != 0 || !ok) {
+        err_printf("Could not write %s", ti->vtt_file);
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+void g2v_thumbnail_default_options(g2v_thumbnail_options* opts, int fps, const char* sheet_file, const char* vtt_file) {
+    memset(opts, 0, sizeof *opts);
+    opts->interval_frames = 5 * fps;
+    opts->width = 160;
+    opts->columns = 10;
+    opts->rows = 10;
+    opts->fps = fps;
+    opts->sheet_file = sheet_file;
+    opts->vtt_file = vtt_file;
+}
+
+int g2v_create_thumbnail_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_thumbnail_options* opts) {
+    int width = opts->width;
+    int height = opts->height > 0 ? opts->height : (int)((long long)width * ctx->height / ctx->width);
+    if(is_tiled(ctx) || width <= 0 || height <= 0 || width > ctx->width || height > ctx->height || opts->columns <= 0 || opts->rows <= 0
+        || opts->interval_frames <= 0 || opts->fps <= 0 || !opts->sheet_file || !is_index_pattern(opts->sheet_file)) {
+        err_printf("Invalid thumbnail options");
+        return G2V_FALSE;
+    }
+    if(!init_downscale_source(ctx)) {
+        return G2V_FALSE;
+    }
+    thumbnail_internals* ti = g2v_calloc(1, sizeof *ti);
+    if(!ti) {
+        err_printf("Could not allocate thumbnail encoder");
+        return G2V_FALSE;
+    }
+    g2v_render_options ropts;
+    g2v_render_default_options(&ropts, width, height);
+    if(!g2v_init_render_ctx_ex(&ti->ctx, &ropts)) {
+        g2v_free(ti);
+        return G2V_FALSE;
+    }
+    ti->interval_frames = opts->interval_frames;
+    ti->rendered_idx = -1;
+    ti->columns = opts->columns;
+    ti->rows = opts->rows;
+    ti->fps = opts->fps;
+    ti->sheet_file = copy_string(opts->sheet_file);
+    ti->vtt_file = opts->vtt_file ? copy_string(opts->vtt_file) : NULL;
+    ti->sheet_size = sizeof(int) * width * height * ti->columns * ti->rows;
+    ti->sheet = g2v_alloc_buffer(ti->sheet_size);
+    if(!ti->sheet) {
+        err_printf("Could not allocate sprite sheet");
+        g2v_free(ti->sheet_file);
+        g2v_free(ti->vtt_file);
+        g2v_free_render_ctx(&ti->ctx);
+        g2v_free(ti);
+        return G2V_FALSE;
+    }
+    memset(ti->sheet, 0, ti->sheet_size);
+
+    memset(&ti->proxy, 0, sizeof ti->proxy);
+    ti->proxy.internal_data = ti;
+    ti->proxy.write_frame_fn = thumbnail_write_thumb;
+
+    enc->internal_data = ti;
+    enc->encode_fn = pipeline_encode;
+    //The work is done by thumbnail_submit_frame(), on the rendering thread
+    enc->write_frame_fn = NULL;
+    enc->submit_frame_fn = thumbnail_submit_frame;
+    enc->end_fn = NULL;
+    return G2V_TRUE;
+}
+
+int g2v_finish_thumbnail_encoder(g2v_encoder* enc) {
+    thumbnail_internals* ti = enc->internal_data;
+    int ret = g2v_end_frames(&ti->proxy, &ti->ctx);
+    //The last sheet, unless it was full (and so already written)
+    if(ret && ti->count % (ti->columns * ti->rows) != 0) {
+        ret = thumbnail_write_sheet(ti);
+    }
+    if(ret && ti->vtt_file) {
+        ret = thumbnail_write_vtt(ti);
+    }
+    g2v_free_buffer(ti->sheet, ti->sheet_size);
+    g2v_free(ti->sheet_file);
+    g2v_free(ti->vtt_file);
+    g2v_free_render_ctx(&ti->ctx);
+    g2v_free(ti);
+    enc->internal_data = NULL;
+    return ret;
+}
+
+/*
+    Tee encoder: frames are handed to the sink threads by reference. A frame keeps its pix_data buffer (swapped with a free
+    one of the pool) until every sink which queued it is done, duplicates reference the buffer of the last frame again.
+*/
+
+#define TEE_DEFAULT_QUEUE 2
+
+typedef struct {
+    int* data;
+    int refs;
+} tee_buffer;
+
+typedef struct {
+    //State of the render context for the frame, with pix_data pointing to buffer
+    g2v_render_ctx state;
+    tee_buffer* buffer;
+} tee_job;
+
+typedef struct tee_internals tee_internals;
+
+typedef struct {
+    tee_internals* tee;
+    g2v_encoder* encoder;
+    int drop_when_full;
+    tee_job* queue;
+    int queue_frames, head, count;
+    //Whether the last frame was skipped, in which case a duplicate of it is a new frame for this sink
+    int skipped;
+    thrd_t thread;
+    int failed;
+} tee_sink;
+
+struct tee_internals {
+    tee_sink sinks[G2V_MAX_SINKS];
+    int sink_count;
+    tee_buffer* buffers;
+    int buffer_count;
+    size_t buffer_size;
+    //Buffer of the last frame, referenced until the next frame with new pixels
+    tee_buffer* last;
+    preview_state preview;
+
+    mtx_t lock;
+    cnd_t changed;
+    //aborted: stopped without g2v_end_frames(), the sink encoders aren't ended
+    int ending, aborted, joined;
+    g2v_render_ctx end_state;
+};
+
+int tee_sink_worker(void* arg) {
+    tee_sink* sink = arg;
+    tee_internals* tee = sink->tee;
+    mtx_lock(&tee->lock);
+    for(;;) {
+        while(sink->count == 0 && !tee->ending) {
+            cnd_wait(&tee->changed, &tee->lock);
+        }
+        if(sink->count == 0) {
+            break;
+        }
+        tee_job* job = &sink->queue[sink->head];
+        int failed = sink->failed;
+        mtx_unlock(&tee->lock);
+        //A failed sink keeps draining its queue, so that it never blocks the render
+        int ok = failed || sink->encoder->write_frame_fn(&job->state, sink->encoder);
+        mtx_lock(&tee->lock);
+        if(!ok) {
+            sink->failed = G2V_TRUE;
+        }
+        job->buffer->refs--;
+        sink->head = (sink->head + 1) % sink->queue_frames;
+        sink->count--;
+        cnd_broadcast(&tee->changed);
+    }
+    int end = !sink->failed && !tee->aborted;
+    mtx_unlock(&tee->lock);
+
+    if(end && sink->encoder->end_fn && !sink->encoder->end_fn(&tee->end_state, sink->encoder)) {
+        mtx_lock(&tee->lock);
+        sink->failed = G2V_TRUE;
+        mtx_unlock(&tee->lock);
+    }
+    return 0;
+}
+
+int tee_write_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    tee_internals* tee = encoder->internal_data;
+    double start = stage_clock();
+    mtx_lock(&tee->lock);
+
+    tee_buffer* buffer = tee->last;
+    if(!ctx->pix_data_duplicate || !buffer) {
+        //The pixels in pix_data move to a free buffer of the pool, and pix_data gets that buffer's memory for the next frame
+        for(;;) {
+            buffer = NULL;
+            for(int i = 0; i < tee->buffer_count && !buffer; i++) {
+                if(tee->buffers[i].refs == 0) {
+                    buffer = &tee->buffers[i];
+                }
+            }
+            if(buffer) {
+                break;
+            }
+            cnd_wait(&tee->changed, &tee->lock);
+        }
+        int* data = buffer->data;
+        buffer->data = ctx->pix_data;
+        ctx->pix_data = data;
+        if(tee->last) {
+            tee->last->refs--;
+        }
+        tee->last = buffer;
+        buffer->refs = 1;
+    }
+
+    for(int i = 0; i < tee->sink_count; i++) {
+        tee_sink* sink = &tee->sinks[i];
+        //Sinks which only submit frames (like the thumbnail encoder) are called by tee_submit_frame() instead
+        if(!sink->encoder->write_frame_fn) {
+            continue;
+        }
+        while(sink->count == sink->queue_frames && !sink->drop_when_full) {
+            cnd_wait(&tee->changed, &tee->lock);
+        }
+        if(sink->count == sink->queue_frames) {
+            sink->skipped = G2V_TRUE;
+            continue;
+        }
+        tee_job* job = &sink->queue[(sink->head + sink->count) % sink->queue_frames];
+        job->state = *ctx;
+        job->state.pix_data = buffer->data;
+        if(sink->skipped) {
+            job->state.pix_data_duplicate = G2V_FALSE;
+            sink->skipped = G2V_FALSE;
+        }
+        job->buffer = buffer;
+        buffer->refs++;
+        sink->count++;
+    }
+    cnd_broadcast(&tee->changed);
+    mtx_unlock(&tee->lock);
+    trace_span("tee", start, stage_clock());
+    return G2V_TRUE;
+}
+
+//Runs on the render thread, so the submit functions of the sinks (e.g. their previews) are called from here
+int tee_submit_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    tee_internals* tee = encoder->internal_data;
+    show_preview(ctx, &tee->preview);
+    for(int i = 0; i < tee->sink_count; i++) {
+        g2v_encoder* sink = tee->sinks[i].encoder;
+        if(sink->submit_frame_fn && !sink->submit_frame_fn(ctx, sink)) {
+            return G2V_FALSE;
+        }
+    }
+    return G2V_TRUE;
+}
+
+//Wait for the sink threads to drain their queues and end their encoders
+int tee_join(tee_internals* tee, const g2v_render_ctx* ctx) {
+    if(tee->joined) {
+        return G2V_TRUE;
+    }
+    mtx_lock(&tee->lock);
+    if(ctx) {
+        tee->end_state = *ctx;
+    }
+    tee->aborted = !ctx;
+    tee->ending = G2V_TRUE;
+    cnd_broadcast(&tee->changed);
+    mtx_unlock(&tee->lock);
+    int ret = G2V_TRUE;
+    for(int i = 0; i < tee->sink_count; i++) {
+        thrd_join(tee->sinks[i].thread, NULL);
+        if(tee->sinks[i].failed) {
+            ret = G2V_FALSE;
+        }
+    }
+    tee->joined = G2V_TRUE;
+    return ret;
+}
+
+int tee_end(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    return tee_join(encoder->internal_data, ctx);
+}
+
+void free_tee(tee_internals* tee) {
+    for(int i = 0; i < tee->sink_count; i++) {
+        g2v_free(tee->sinks[i].queue);
+    }
+    for(int i = 0; i < tee->buffer_count; i++) {
+        g2v_free_buffer(tee->buffers[i].data, tee->buffer_size);
+    }
+    g2v_free(tee->buffers);
+    mtx_destroy(&tee->lock);
+    cnd_destroy(&tee->changed);
+    g2v_free(tee);
+}
+
+int g2v_create_tee_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_tee_sink* sinks, int count, const g2v_preview_options* preview) {
+    if(count < 1 || count > G2V_MAX_SINKS) {
+        err_printf("Invalid number of sinks: %d", count);
+        return G2V_FALSE;
+    }
+    if(is_tiled(ctx) || ctx->track_damage) {
+        //pix_data changes buffer every frame, so it can't be patched with the damage of the next frame
+        err_printf("Tee encoders can't be combined with tiling or track_damage");
+        return G2V_FALSE;
+    }
+    for(int i = 0; i < count; i++) {
+        if(!sinks[i].encoder || (!sinks[i].encoder->write_frame_fn && !sinks[i].encoder->submit_frame_fn)) {
+            err_printf("Sink %d can't write frames", i);
+            return G2V_FALSE;
+        }
+    }
+
+    tee_internals* tee = g2v_calloc(1, sizeof *tee);
+    if(!tee) {
+        err_printf("Could not allocate tee encoder");
+        return G2V_FALSE;
+    }
+    mtx_init(&tee->lock, mtx_plain);
+    cnd_init(&tee->changed);
+
+    //Enough buffers for full queues of different frames in every sink, the last frame and the one being mapped
+    tee->buffer_size = sizeof(int) * ctx->width * ctx->height;
+    int buffer_count = 2;
+    for(int i = 0; i < count; i++) {
+        tee_sink* sink = &tee->sinks[i];
+        sink->tee = tee;
+        sink->encoder = sinks[i].encoder;
+        sink->drop_when_full = sinks[i].drop_when_full;
+        sink->queue_frames = sinks[i].queue_frames > 0 ? sinks[i].queue_frames : TEE_DEFAULT_QUEUE;
+        sink->queue = g2v_calloc(sink->queue_frames, sizeof *sink->queue);
+        tee->sink_count++;
+        if(!sink->queue) {
+            err_printf("Could not allocate tee encoder");
+            goto fail;
+        }
+        buffer_count += sink->queue_frames;
+    }
+    tee->buffers = g2v_calloc(buffer_count, sizeof *tee->buffers);
+    if(!tee->buffers) {
+        err_printf("Could not allocate tee encoder");
+        goto fail;
+    }
+    for(; tee->buffer_count < buffer_count; tee->buffer_count++) {
+        tee->buffers[tee->buffer_count].data = g2v_alloc_buffer(tee->buffer_size);
+        if(!tee->buffers[tee->buffer_count].data) {
+            err_printf("Could not allocate pixel buffer");
+            goto fail;
+        }
+    }
+
+    for(int i = 0; i < count; i++) {
+        if(thrd_create(&tee->sinks[i].thread, tee_sink_worker, &tee->sinks[i]) != thrd_success) {
+            err_printf("Could not create sink thread");
+            //Stop the threads already started
+            tee->sink_count = i;
+            tee_join(tee, NULL);
+            tee->sink_count = count;
+            goto fail;
+        }
+    }
+
+    init_preview(&tee->preview, preview);
+    enc->internal_data = tee;
+    enc->encode_fn = pipeline_encode;
+    enc->write_frame_fn = tee_write_frame;
+    enc->submit_frame_fn = tee_submit_frame;
+    enc->end_fn = tee_end;
+    return G2V_TRUE;
+
+fail:
+    free_tee(tee);
+    return G2V_FALSE;
+}
+
+int g2v_finish_tee_encoder(g2v_encoder* enc) {
+    tee_internals* tee = enc->internal_data;
+    //Without g2v_end_frames(), the sinks are stopped without ending them
+    int ret = tee_join(tee, NULL);
+    finish_preview(&tee->preview);
+    free_tee(tee);
+    enc->internal_data = NULL;
+    return ret;
+}
+
+#ifdef G2V_USE_FFMPEG_ENCODER
+
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
+#include "libswscale/swscale.h"
+
+typedef struct {
+    AVStream* stream;
+    AVCodec* codec;
+    AVCodecContext* codec_ctx;
+    AVFrame* frame;
+    int64_t next_pts;
+    int encoding;
+} ffmpeg_output_stream;
+
+typedef struct {
+    ffmpeg_output_stream video, audio;
+    AVFormatContext* output_ctx;
+    struct SwsContext *sws_ctx;
+    //With damage tracking, sws_ctx converts bands of band_rows rows, and tail_sws_ctx the last partial band (if any)
+    struct SwsContext *tail_sws_ctx;
+    int band_rows;
+    int width, height, fps;
+    char* output_file;
+
+    //Pixel formats of pix_data and of the encoded frames. With direct, both have the same layout and frames are only copied
+    enum AVPixelFormat src_fmt, pix_fmt;
+    int direct;
+    //Flat frames in formats other than YUV420P are converted from a frame of flat_color, refilled when it changes
+    int* flat_pixels;
+    int flat_color;
+
+    //Resumable mode, output_ctx is the currently open segment (or NULL between segments)
+    int segment_frames;
+    int segment_index;
+    int segment_count;
+    char* journal_file;
+    //Set once the end function completed, only then are the segments concatenated
+    int ended;
+
+    char* codec_name;
+    char* preset;
+    char* codec_options;
+
+    //Duplicate frames are left out if the container has timestamps, dropped_frame_index is the last one left out (or -1)
+    int drop_duplicates;
+    int dropped_frame_index;
+
+    //Reused for every packet, with buffers from packet_pool (if the encoder lets us provide them)
+    AVPacket* packet;
+    AVBufferPool* packet_pool;
+    size_t packet_pool_size;
+
+    preview_state preview;
+
+    g2v_timings* timings;
+} ffmpeg_internals;
+
+#define G2V_EOF 2
+#define FFMPEG_BAND_ROWS 16
+
+int ffmpeg_write_frame(ffmpeg_internals* fi, ffmpeg_output_stream* stream, AVFrame* frame) {
+    double start = stage_clock(), mux_time = 0;
+    int packets = 0;
+    int ret = avcodec_send_frame(stream->codec_ctx, frame);
+    if(ret < 0) {
+        err_printf("Error sending frame");
+        return G2V_FALSE;
+    }
+
+    AVPacket* pkt = fi->packet;
+    while(ret >= 0) {
+        ret = avcodec_receive_packet(stream->codec_ctx, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            break;
+        else if (ret < 0) {
+            err_printf("Error encoding frame");
+            return G2V_FALSE;
+        }
+
+        double mux_start = stage_clock();
+        av_packet_rescale_ts(pkt, stream->codec_ctx->time_base, stream->stream->time_base);
+        pkt->stream_index = stream->stream->index;
+        //With a single stream there is nothing to interleave, and skipping the interleaving queue avoids allocating an entry per packet
+        if(fi->output_ctx->nb_streams > 1) {
+            ret = av_interleaved_write_frame(fi->output_ctx, pkt);
+        } else {
+            ret = av_write_frame(fi->output_ctx, pkt);
+        }
+        av_packet_unref(pkt);
+        packets++;
+        double mux_end = stage_clock();
+        mux_time += mux_end - mux_start;
+        trace_span("mux", mux_start, mux_end);
+        if(ret < 0) {
+            err_printf("Error writing packet");
+        }
+    }
+
+    double end = stage_clock();
+    //Drain calls which didn't write anything would only add near zero samples
+    if(frame || packets > 0) {
+        record_stage(fi->timings, G2V_STAGE_ENCODE, end - start - mux_time);
+        record_stage(fi->timings, G2V_STAGE_MUX, mux_time);
+        trace_span("encode", start, end);
+    }
+    return ret == AVERROR_EOF ? G2V_EOF : G2V_TRUE;
+}
+
+#if LIBAVUTIL_VERSION_MAJOR < 57
+typedef int buffer_size_t;
+#else
+typedef size_t buffer_size_t;
+#endif
+
+void ffmpeg_free_buffer(void* opaque, uint8_t* data) {
+    g2v_free_buffer(data, (size_t)(uintptr_t)opaque);
+}
+
+//Wraps a buffer of the gl2vid allocator, the size is kept as opaque for freeing
+AVBufferRef* ffmpeg_create_buffer(size_t size) {
+    uint8_t* data = g2v_alloc_buffer(size);
+    if(!data) {
+        return NULL;
+    }
+    AVBufferRef* buf = av_buffer_create(data, size, ffmpeg_free_buffer, (void*)(uintptr_t)size, 0);
+    if(!buf) {
+        g2v_free_buffer(data, size);
+    }
+    return buf;
+}
+
+//Only called when the pool has no free buffer, so every call is a real allocation
+AVBufferRef* ffmpeg_alloc_packet_buffer(buffer_size_t size) {
+    return ffmpeg_create_buffer(size);
+}
+
+//Allocates the planes of a frame (whose format, width and height are set) with the gl2vid allocator
+int ffmpeg_alloc_frame_buffer(AVFrame* frame) {
+    int size = av_image_get_buffer_size(frame->format, frame->width, frame->height, G2V_BUFFER_ALIGNMENT);
+    if(size < 0) {
+        return G2V_FALSE;
+    }
+    frame->buf[0] = ffmpeg_create_buffer(size);
+    if(!frame->buf[0]) {
+        return G2V_FALSE;
+    }
+    return av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, frame->format, frame->width, frame->height, G2V_BUFFER_ALIGNMENT) >= 0;
+}
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+/**
+ * Packet buffers come from a pool instead of a fresh allocation per packet. Large buffers (e.g. keyframes)
+ * would otherwise be mmap()ed and unmapped again for every packet by most allocators.
+ */
+int ffmpeg_get_encode_buffer(AVCodecContext* c, AVPacket* pkt, int flags) {
+    (void)flags;
+    ffmpeg_internals* fi = c->opaque;
+    size_t size = (size_t)pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+    if(size > fi->packet_pool_size) {
+        //Buffers of the old pool stay valid until released, the pool is freed after the last one
+        av_buffer_pool_uninit(&fi->packet_pool);
+        fi->packet_pool_size = size * 2;
+        fi->packet_pool = av_buffer_pool_init(fi->packet_pool_size, ffmpeg_alloc_packet_buffer);
+        if(!fi->packet_pool) {
+            fi->packet_pool_size = 0;
+            return AVERROR(ENOMEM);
+        }
+    }
+    pkt->buf = av_buffer_pool_get(fi->packet_pool);
+    if(!pkt->buf) {
+        return AVERROR(ENOMEM);
+    }
+    pkt->data = pkt->buf->data;
+    memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+#endif
+
+int ffmpeg_create_stream(ffmpeg_internals* fi, AVOutputFormat* fmt, ffmpeg_output_stream* os, AVCodec* codec) {
+    os->codec = codec;
+    if(!os->codec) {
+        err_printf("Encoder not found");
+        return G2V_FALSE;
+    }
+    os->stream = avformat_new_stream(fi->output_ctx, NULL);
+    if(!os->stream) {
+        err_printf("Stream allocation failed");
+        return G2V_FALSE;
+    }
+    os->stream->id = fi->output_ctx->nb_streams - 1;
+    AVCodecContext* c = avcodec_alloc_context3(os->codec);
+    if(!c) {
+        err_printf("Codec allocation failed");
+        return G2V_FALSE;
+    }
+    os->codec_ctx = c;
+    os->encoding = G2V_TRUE;
+
+    if (fi->output_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+
+    return G2V_TRUE;
+}
+
+void ffmpeg_free_stream(ffmpeg_output_stream* stream) {
+    avcodec_free_context(&stream->codec_ctx);
+}
+
+/**
+ * Open an output file with a freshly opened video codec, so every output (or segment) starts with a closed GOP.
+ */
+int ffmpeg_open_output(ffmpeg_internals* fi, const char* output_file) {
+    avformat_alloc_output_context2(&fi->output_ctx, NULL, NULL, output_file);
+    if(!fi->output_ctx) {
+        err_printf("Could not allocate format context");
+        goto fail1;
+    }
+    AVOutputFormat* fmt = fi->output_ctx->oformat;
+
+    AVCodec* codec = fi->codec_name ? avcodec_find_encoder_by_name(fi->codec_name) : avcodec_find_encoder(fmt->video_codec);
+    if(!ffmpeg_create_stream(fi, fmt, &fi->video, codec)) {
+        err_printf("Video stream creation failed");
+        goto fail2;
+    }
+
+    AVCodecContext* c = fi->video.codec_ctx;
+    c->codec_id = codec->id;
+    c->width = fi->width;
+    c->height = fi->height;
+    fi->video.stream->time_base = (AVRational) { 1, fi->fps };
+    c->time_base = fi->video.stream->time_base;
+    c->pix_fmt = fi->pix_fmt;
+    if(fi->segment_frames > 0) {
+        c->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    }
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+    if(codec->capabilities & AV_CODEC_CAP_DR1) {
+        c->opaque = fi;
+        c->get_encode_buffer = ffmpeg_get_encode_buffer;
+    }
+#endif
+
+    AVDictionary* codec_opts = NULL;
+    if(fi->preset) {
+        av_dict_set(&codec_opts, "preset", fi->preset, 0);
+    }
+    if(fi->codec_options && av_dict_parse_string(&codec_opts, fi->codec_options, "=", ":", 0) < 0) {
+        err_printf("Invalid codec options: %s", fi->codec_options);
+        av_dict_free(&codec_opts);
+        goto fail3;
+    }
+    int ret = avcodec_open2(c, fi->video.codec, &codec_opts);
+    av_dict_free(&codec_opts);
+    if(ret < 0) {
+        err_printf("Could not open codec");
+        goto fail3;
+    }
+
+    if(avcodec_parameters_from_context(fi->video.stream->codecpar, c) < 0) {
+        err_printf("Could not copy encoding parameters");
+        goto fail3;
+    }
+
+    if(fi->segment_frames == 0) {
+        av_dump_format(fi->output_ctx, 0, output_file, 1);
+    }
+
+    if (!(fmt->flags & AVFMT_NOFILE)) {
+        if(avio_open(&fi->output_ctx->pb, output_file, AVIO_FLAG_WRITE) < 0) {
+            err_printf("Could not open file: %s", output_file);
+            goto fail3;
+        }
+    }
+
+    if(avformat_write_header(fi->output_ctx, NULL) < 0) {
+        err_printf("Could not write header for file: %s", output_file);
+        goto fail4;
+    }
+
+    return G2V_TRUE;
+
+fail4:
+    avio_closep(&fi->output_ctx->pb);
+fail3:
+    ffmpeg_free_stream(&fi->video);
+fail2:
+    avformat_free_context(fi->output_ctx);
+    fi->output_ctx = NULL;
+fail1:
+    return G2V_FALSE;
+}
+
+int ffmpeg_close_output(ffmpeg_internals* fi) {
+    int ret = av_write_trailer(fi->output_ctx);
+    avio_closep(&fi->output_ctx->pb);
     ffmpeg_free_stream(&fi->video);
     if(fi->audio.stream) {
         ffmpeg_free_stream(&fi->audio);
     }
-    avformat_free_context(fi->output_ctx);
+    avformat_free_context(fi->output_ctx);
+    fi->output_ctx = NULL;
+    if(ret < 0) {
+        err_printf("Could not write trailer");
+        return G2V_FALSE;
+    }
+    return G2V_TRUE;
+}
+
+char* ffmpeg_segment_filename(const char* output_file, int index) {
+    const char* ext = strrchr(output_file, '.');
+    if(!ext || strchr(ext, '/') || strchr(ext, '\\')) {
+        ext = output_file + strlen(output_file);
+    }
+    size_t size = strlen(output_file) + 16;
+    char* filename = g2v_malloc(size);
+    snprintf(filename, size, "%.*s.seg%05d%s", (int)(ext - output_file), output_file, index, ext);
+    return filename;
+}
+
+/**
+ * Read the journal of a resumable encoder, returns the number of completed segments or -1 if the journal
+ * doesn't belong to this render. A missing journal is created.
+ */
+int ffmpeg_read_journal(ffmpeg_internals* fi) {
+    FILE* f = fopen(fi->journal_file, "r");
+    if(!f) {
+        f = fopen(fi->journal_file, "w");
+        if(!f) {
+            err_printf("Could not create journal: %s", fi->journal_file);
+            return -1;
+        }
+        fprintf(f, "g2v-journal %d %d %d %d\n", fi->fps, fi->segment_frames, fi->width, fi->height);
+        fclose(f);
+        return 0;
+    }
+
+    int fps, segment_frames, width, height;
+    if(fscanf(f, "g2v-journal %d %d %d %d", &fps, &segment_frames, &width, &height) != 4
+        || fps != fi->fps || segment_frames != fi->segment_frames || width != fi->width || height != fi->height) {
+        err_printf("Journal %s was written with different encoder settings", fi->journal_file);
+        fclose(f);
+        return -1;
+    }
+
+    //Segments are always completed in order, a torn last line (crash while journaling) is simply ignored
+    int completed = 0, index, first, last;
+    while(fscanf(f, " segment %d %d %d", &index, &first, &last) == 3 && index == completed) {
+        completed++;
+    }
+    fclose(f);
+    return completed;
+}
+
+int ffmpeg_open_segment(ffmpeg_internals* fi, int index) {
+    char* filename = ffmpeg_segment_filename(fi->output_file, index);
+    int ret = ffmpeg_open_output(fi, filename);
+    g2v_free(filename);
+    fi->segment_index = index;
+    return ret;
+}
+
+int ffmpeg_close_segment(ffmpeg_internals* fi, int last_frame_index) {
+    //Drain the encoder, so the segment contains every frame submitted to it
+    int ret;
+    while((ret = ffmpeg_write_frame(fi, &fi->video, NULL)) == G2V_TRUE);
+    if(ret == G2V_FALSE || !ffmpeg_close_output(fi)) {
+        return G2V_FALSE;
+    }
+
+    //The journal entry is only written once the segment is completely on disk
+    FILE* f = fopen(fi->journal_file, "a");
+    if(!f) {
+        err_printf("Could not open journal: %s", fi->journal_file);
+        return G2V_FALSE;
+    }
+    fprintf(f, "segment %d %d %d\n", fi->segment_index, fi->segment_index * fi->segment_frames, last_frame_index);
+    fclose(f);
+
+    fi->segment_count = fi->segment_index + 1;
+    return G2V_TRUE;
+}
+
+int ffmpeg_concat_segments(ffmpeg_internals* fi) {
+    //A render without any frame has no segment to take the stream from
+    if(fi->segment_count == 0) {
+        return G2V_TRUE;
+    }
+    AVFormatContext* output_ctx = NULL;
+    AVStream* output_stream = NULL;
+    avformat_alloc_output_context2(&output_ctx, NULL, NULL, fi->output_file);
+    if(!output_ctx) {
+        err_printf("Could not allocate format context");
+        return G2V_FALSE;
+    }
+
+    int ret = G2V_TRUE;
+    for(int i = 0; i < fi->segment_count && ret; i++) {
+        char* filename = ffmpeg_segment_filename(fi->output_file, i);
+        AVFormatContext* input_ctx = NULL;
+        if(avformat_open_input(&input_ctx, filename, NULL, NULL) < 0 || avformat_find_stream_info(input_ctx, NULL) < 0) {
+            err_printf("Could not read segment: %s", filename);
+            avformat_close_input(&input_ctx);
+            g2v_free(filename);
+            ret = G2V_FALSE;
+            break;
+        }
+        g2v_free(filename);
+        AVStream* input_stream = input_ctx->streams[0];
+
+        if(i == 0) {
+            output_stream = avformat_new_stream(output_ctx, NULL);
+            if(!output_stream || avcodec_parameters_copy(output_stream->codecpar, input_stream->codecpar) < 0) {
+                err_printf("Could not create output stream");
+                ret = G2V_FALSE;
+            } else {
+                output_stream->codecpar->codec_tag = 0;
+                output_stream->time_base = input_stream->time_base;
+                if(!(output_ctx->oformat->flags & AVFMT_NOFILE) && avio_open(&output_ctx->pb, fi->output_file, AVIO_FLAG_WRITE) < 0) {
+                    err_printf("Could not open file: %s", fi->output_file);
+                    ret = G2V_FALSE;
+                } else if(avformat_write_header(output_ctx, NULL) < 0) {
+                    err_printf("Could not write header for file: %s", fi->output_file);
+                    ret = G2V_FALSE;
+                }
+            }
+        }
+
+        //Segments keep the timestamps of the whole render, so packets are copied as they are
+        AVPacket pkt = { NULL };
+        while(ret && av_read_frame(input_ctx, &pkt) >= 0) {
+            if(pkt.stream_index == 0) {
+                av_packet_rescale_ts(&pkt, input_stream->time_base, output_stream->time_base);
+                pkt.pos = -1;
+                if(av_interleaved_write_frame(output_ctx, &pkt) < 0) {
+                    err_printf("Error writing packet");
+                    ret = G2V_FALSE;
+                }
+            }
+            av_packet_unref(&pkt);
+        }
+        avformat_close_input(&input_ctx);
+    }
+
+    if(ret && av_write_trailer(output_ctx) < 0) {
+        err_printf("Could not write trailer");
+        ret = G2V_FALSE;
+    }
+    avio_closep(&output_ctx->pb);
+    avformat_free_context(output_ctx);
+    return ret;
+}
+
+/**
+ * Fill a YUV420P frame with a single RGB32 colour, converted like sws_scale does by default (BT.601, limited range).
+ */
+void ffmpeg_fill_frame(AVFrame* frame, int color) {
+    double r = ((color >> 16) & 0xff) / 255.0, g = ((color >> 8) & 0xff) / 255.0, b = (color & 0xff) / 255.0;
+    int value[3] = {
+        (int)(16 + 65.481 * r + 128.553 * g + 24.966 * b + 0.5),
+        (int)(128 - 37.797 * r - 74.203 * g + 112.0 * b + 0.5),
+        (int)(128 + 112.0 * r - 93.786 * g - 18.214 * b + 0.5),
+    };
+    for(int plane = 0; plane < 3; plane++) {
+        int width = plane == 0 ? frame->width : (frame->width + 1) / 2;
+        int height = plane == 0 ? frame->height : (frame->height + 1) / 2;
+        for(int y = 0; y < height; y++) {
+            memset(frame->data[plane] + (size_t)y * frame->linesize[plane], value[plane], width);
+        }
+    }
+}
+
+//Write the last duplicate frame left out, so that the frame before it is shown for the right duration
+int ffmpeg_write_dropped_frame(ffmpeg_internals* fi) {
+    if(fi->dropped_frame_index < 0) {
+        return G2V_TRUE;
+    }
+    fi->video.frame->pts = fi->dropped_frame_index;
+    fi->dropped_frame_index = -1;
+    return ffmpeg_write_frame(fi, &fi->video, fi->video.frame) != G2V_FALSE;
+}
+
+/**
+ * Convert rows [y0, y1) of pixels (laid out like pix_data) into the video frame. Without damage tracking, the whole frame is converted at once.
+ */
+void ffmpeg_convert_rows(ffmpeg_internals* fi, const int* pixels, int y0, int y1) {
+    AVFrame* frame = fi->video.frame;
+    uint8_t* planes[4];
+    int in_linesize[4];
+    av_image_fill_arrays(planes, in_linesize, (const uint8_t*)pixels, fi->src_fmt, fi->width, fi->height, 1);
+    if(fi->direct) {
+        //Same layout as the frame, the rows are only copied
+        for(int plane = 0; plane < 4 && planes[plane]; plane++) {
+            av_image_copy_plane(frame->data[plane] + (size_t)y0 * frame->linesize[plane], frame->linesize[plane],
+                planes[plane] + (size_t)y0 * in_linesize[plane], in_linesize[plane], in_linesize[plane], y1 - y0);
+        }
+        return;
+    }
+    if(!fi->band_rows) {
+        sws_scale(fi->sws_ctx, (const uint8_t* const*)planes, in_linesize, 0, fi->height, frame->data, frame->linesize);
+        return;
+    }
+    //Every band is converted as an independent image, so converting a band alone gives the same result as a whole frame
+    for(int y = y0 / fi->band_rows * fi->band_rows; y < y1; y += fi->band_rows) {
+        int rows = fi->height - y < fi->band_rows ? fi->height - y : fi->band_rows;
+        const uint8_t* src[1] = { (const uint8_t*)(pixels + (size_t)y * fi->width) };
+        uint8_t* dst[3] = {
+            frame->data[0] + (size_t)y * frame->linesize[0],
+            frame->data[1] + (size_t)(y / 2) * frame->linesize[1],
+            frame->data[2] + (size_t)(y / 2) * frame->linesize[2],
+        };
+        sws_scale(rows == fi->band_rows ? fi->sws_ctx : fi->tail_sws_ctx, src, in_linesize, 0, rows, dst, frame->linesize);
+    }
+}
+
+//Fill the video frame with the colour of a flat frame
+int ffmpeg_fill_flat_frame(ffmpeg_internals* fi, int color) {
+    if(fi->pix_fmt == AV_PIX_FMT_YUV420P) {
+        ffmpeg_fill_frame(fi->video.frame, color);
+        return G2V_TRUE;
+    }
+    size_t pixels = (size_t)fi->width * fi->height;
+    if(!fi->flat_pixels || fi->flat_color != color) {
+        if(!fi->flat_pixels && !(fi->flat_pixels = g2v_alloc_buffer(sizeof(int) * pixels))) {
+            err_printf("Could not allocate flat frame");
+            return G2V_FALSE;
+        }
+        for(size_t i = 0; i < pixels; i++) {
+            fi->flat_pixels[i] = color;
+        }
+        fi->flat_color = color;
+    }
+    ffmpeg_convert_rows(fi, fi->flat_pixels, 0, fi->height);
+    return G2V_TRUE;
+}
+
+int ffmpeg_write_video_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_internals* fi = encoder->internal_data;
+    int frame_index = ctx->pix_data_frame_index;
+    int last_of_segment = fi->segment_frames > 0 && (frame_index + 1) % fi->segment_frames == 0;
+    if(fi->segment_frames > 0 && !fi->output_ctx) {
+        if(!ffmpeg_open_segment(fi, frame_index / fi->segment_frames)) {
+            return G2V_FALSE;
+        }
+    }
+
+    if(ctx->pix_data_duplicate) {
+        //The frame still holds the converted pixels of the previous frame, which are the same
+        if(fi->drop_duplicates && !(fi->output_ctx->oformat->flags & AVFMT_NOTIMESTAMPS) && !last_of_segment) {
+            fi->dropped_frame_index = frame_index;
+            fi->video.next_pts = frame_index + 1;
+            return G2V_TRUE;
+        }
+    } else {
+        //The encoder may still hold a reference to the previous frame, in which case a new buffer is allocated
+        if(!av_frame_is_writable(fi->video.frame)) {
+            atomic_fetch_add_explicit(&g2v_alloc_counter, 1, memory_order_relaxed);
+        }
+        if(av_frame_make_writable(fi->video.frame) < 0) {
+            err_printf("Could not make frame writable");
+            return G2V_FALSE;
+        }
+        double start = stage_clock();
+        if(ctx->pix_data_flat) {
+            if(!ffmpeg_fill_flat_frame(fi, ctx->pix_data_flat_color)) {
+                return G2V_FALSE;
+            }
+        } else {
+            ffmpeg_convert_rows(fi, ctx->pix_data, ctx->pix_data_dirty_y0, ctx->pix_data_dirty_y1);
+        }
+        double end = stage_clock();
+        record_stage(fi->timings, G2V_STAGE_CONVERT, end - start);
+        trace_span("convert", start, end);
+    }
+    fi->dropped_frame_index = -1;
+    fi->video.frame->pts = frame_index;
+    fi->video.next_pts = frame_index + 1;
+
+    if(ffmpeg_write_frame(fi, &fi->video, fi->video.frame) == G2V_FALSE) {
+        return G2V_FALSE;
+    }
+
+    if(last_of_segment) {
+        return ffmpeg_close_segment(fi, frame_index);
+    }
+    return G2V_TRUE;
+}
+
+int ffmpeg_submit_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_internals* fi = encoder->internal_data;
+    show_preview(ctx, &fi->preview);
+    return G2V_TRUE;
+}
+
+int ffmpeg_end_video(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_internals* fi = encoder->internal_data;
+    if(fi->output_ctx && !ffmpeg_write_dropped_frame(fi)) {
+        return G2V_FALSE;
+    }
+    if(fi->segment_frames > 0) {
+        fi->ended = !fi->output_ctx || ffmpeg_close_segment(fi, ctx->pix_data_frame_index);
+        return fi->ended;
+    }
+    int ret;
+    while((ret = ffmpeg_write_frame(fi, &fi->video, NULL)) == G2V_TRUE);
+    return ret == G2V_EOF;
+}
+
+int ffmpeg_encode(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_internals* fi = encoder->internal_data;
+
+    while(fi->audio.encoding || fi->video.encoding) {
+        int encode_audio = !fi->video.encoding;
+        if(!encode_audio) {
+            if(fi->audio.encoding) {
+                encode_audio = av_compare_ts(fi->video.next_pts, fi->video.codec_ctx->time_base, fi->audio.next_pts, fi->audio.codec_ctx->time_base) <= 0;
+            }
+        }
+
+        if(!encode_audio) {
+            //Encode video, frames are written to the encoder by the pipeline once their readback completes
+            if(!g2v_begin_frame(encoder, ctx)) {
+                return G2V_FALSE;
+            }
+            int eof = render_whole_frame(encoder, ctx);
+            if(eof < 0) {
+                return G2V_FALSE;
+            } else if(eof) {
+                if(!g2v_end_frames(encoder, ctx)) {
+                    return G2V_FALSE;
+                }
+                fi->video.encoding = G2V_FALSE;
+            } else if(!g2v_submit_frame(encoder, ctx) || g2v_poll(encoder, ctx) < 0) {
+                return G2V_FALSE;
+            }
+        } else {
+            
+        }
+    }
+
+    return G2V_TRUE;
+}
+
+/**
+ * Pixel format the codec encodes frames in: the layout of pix_data itself if the codec accepts it,
+ * otherwise the closest format it accepts.
+ */
+enum AVPixelFormat ffmpeg_negotiate_pix_fmt(const ffmpeg_internals* fi) {
+    const AVOutputFormat* fmt = av_guess_format(NULL, fi->output_file, NULL);
+    AVCodec* codec = fi->codec_name ? avcodec_find_encoder_by_name(fi->codec_name) : fmt ? avcodec_find_encoder(fmt->video_codec) : NULL;
+    if(!codec || !codec->pix_fmts) {
+        return AV_PIX_FMT_YUV420P;
+    }
+    for(const enum AVPixelFormat* p = codec->pix_fmts; *p != AV_PIX_FMT_NONE; p++) {
+        //BGR0 has the layout of BGRA, with the alpha byte ignored
+        if(*p == fi->src_fmt || (fi->src_fmt == AV_PIX_FMT_BGRA && *p == AV_PIX_FMT_BGR0)) {
+            return *p;
+        }
+    }
+    return avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, fi->src_fmt, 0, NULL);
+}
+
+void g2v_ffmpeg_default_options(g2v_ffmpeg_options* opts, int fps, const char* output_file) {
+    memset(opts, 0, sizeof *opts);
+    opts->fps = fps;
+    opts->output_file = output_file;
+}
+
+void g2v_ffmpeg_intermediate_options(g2v_ffmpeg_options* opts, int fps, const char* output_file, g2v_intermediate_codec codec) {
+    g2v_ffmpeg_default_options(opts, fps, output_file);
+    opts->rgb_direct = G2V_TRUE;
+    if(codec == G2V_INTERMEDIATE_UTVIDEO) {
+        opts->codec_name = "utvideo";
+        opts->codec_options = "pred=left:slices=24:threads=auto";
+    } else {
+        //Slices need version 3, every slice is compressed by its own thread
+        opts->codec_name = "ffv1";
+        opts->codec_options = "level=3:g=1:slices=24:slicecrc=1:threads=auto";
+    }
+}
+
+int g2v_create_ffmpeg_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, int fps, const char* output_file) {
+    g2v_ffmpeg_options opts;
+    g2v_ffmpeg_default_options(&opts, fps, output_file);
+    return g2v_create_ffmpeg_encoder_ex(enc, ctx, &opts);
+}
+
+int g2v_create_ffmpeg_encoder_ex(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_ffmpeg_options* opts) {
+    if(opts->preview && is_tiled(ctx)) {
+        //Tiles are submitted one by one, the render targets never hold a whole frame to show
+        err_printf("Previews can't be combined with tiling");
+        return G2V_FALSE;
+    }
+    ffmpeg_internals* fi = g2v_calloc(1, sizeof* fi);
+    fi->width = ctx->width;
+    fi->height = ctx->height;
+    fi->fps = opts->fps;
+    fi->output_file = copy_string(opts->output_file);
+    fi->segment_frames = opts->segment_frames > 0 ? opts->segment_frames : 0;
+    fi->segment_index = -1;
+    fi->timings = ctx->timings;
+    fi->codec_name = opts->codec_name ? copy_string(opts->codec_name) : NULL;
+    fi->drop_duplicates = opts->drop_duplicates;
+    fi->dropped_frame_index = -1;
+    fi->preset = opts->preset ? copy_string(opts->preset) : NULL;
+    fi->codec_options = opts->codec_options ? copy_string(opts->codec_options) : NULL;
+    fi->src_fmt = ctx->pixel_format == G2V_PIXELS_GBRP ? AV_PIX_FMT_GBRP : AV_PIX_FMT_BGRA;
+    fi->pix_fmt = opts->rgb_direct ? ffmpeg_negotiate_pix_fmt(fi) : AV_PIX_FMT_YUV420P;
+    fi->direct = fi->pix_fmt == fi->src_fmt || (fi->src_fmt == AV_PIX_FMT_BGRA && fi->pix_fmt == AV_PIX_FMT_BGR0);
+
+    if(fi->segment_frames > 0) {
+        if(opts->journal_file) {
+            fi->journal_file = copy_string(opts->journal_file);
+        } else {
+            fi->journal_file = g2v_malloc(strlen(opts->output_file) + sizeof ".journal");
+            sprintf(fi->journal_file, "%s.journal", opts->output_file);
+        }
+
+        int completed = ffmpeg_read_journal(fi);
+        if(completed < 0) {
+            goto fail1;
+        }
+        //Segments are opened lazily on their first frame, resuming after the last completed one
+        fi->segment_count = completed;
+        ctx->current_frame_index = completed * fi->segment_frames;
+        ctx->pending_frames = 0;
+        fi->video.encoding = G2V_TRUE;
+    } else if(!ffmpeg_open_output(fi, opts->output_file)) {
+        goto fail1;
+    }
+
+    fi->video.frame = av_frame_alloc();
+    fi->packet = av_packet_alloc();
+    if(!fi->video.frame || !fi->packet) {
+        err_printf("Could not allocate frame");
+        goto fail2;
+    }
+
+    fi->audio.encoding = G2V_FALSE;
+    fi->video.next_pts = ctx->current_frame_index;
+    fi->video.frame->width = fi->width;
+    fi->video.frame->height = fi->height;
+    fi->video.frame->format = fi->pix_fmt;
+    
+    if(!ffmpeg_alloc_frame_buffer(fi->video.frame)) {
+        err_printf("Could not allocate raw picture buffer");
+        goto fail2;
+    }
+
+    if(fi->direct) {
+        //Frames are copied as they are, damaged ones only their dirty rows
+    } else if(ctx->track_damage && ctx->height > FFMPEG_BAND_ROWS && fi->pix_fmt == AV_PIX_FMT_YUV420P) {
+        //Converted in bands of macroblock rows, so that damaged frames only convert the rows they touch
+        fi->band_rows = FFMPEG_BAND_ROWS;
+        fi->sws_ctx = sws_getContext(ctx->width, fi->band_rows, fi->src_fmt, ctx->width, fi->band_rows, fi->pix_fmt, opts->sws_flags, NULL, NULL, NULL);
+        int tail = ctx->height % fi->band_rows;
+        if(tail) {
+            fi->tail_sws_ctx = sws_getContext(ctx->width, tail, fi->src_fmt, ctx->width, tail, fi->pix_fmt, opts->sws_flags, NULL, NULL, NULL);
+            if(!fi->tail_sws_ctx) {
+                err_printf("Could not allocate SwsContext");
+                goto fail2;
+            }
+        }
+    } else {
+        fi->sws_ctx = sws_getContext(ctx->width, ctx->height, fi->src_fmt, ctx->width, ctx->height, fi->pix_fmt, opts->sws_flags, NULL, NULL, NULL);
+    }
+    if(!fi->direct && !fi->sws_ctx) {
+        err_printf("Could not allocate SwsContext");
+        goto fail2;
+    }
+
+    enc->internal_data = fi;
+    enc->encode_fn = ffmpeg_encode;
+    enc->write_frame_fn = ffmpeg_write_video_frame;
+    enc->submit_frame_fn = opts->preview ? ffmpeg_submit_frame : NULL;
+    enc->end_fn = ffmpeg_end_video;
+    init_preview(&fi->preview, opts->preview);
+
+    return G2V_TRUE;
+
+fail2:
+    sws_freeContext(fi->sws_ctx);
+    sws_freeContext(fi->tail_sws_ctx);
+    av_frame_free(&fi->video.frame);
+    av_packet_free(&fi->packet);
+    if(fi->output_ctx) {
+        ffmpeg_close_output(fi);
+    }
+fail1:
+    g2v_free(fi->codec_name);
+    g2v_free(fi->preset);
+    g2v_free(fi->codec_options);
+    g2v_free(fi->journal_file);
+    g2v_free(fi->output_file);
+    g2v_free(fi);
+    return G2V_FALSE;
+}
+
+/*
+    Ladder encoder: one ffmpeg encoder per rendition, each one fed by a worker thread. The pipeline of a render context
+    hands completed frames to a rendition through its proxy encoder, and the worker converts and encodes them while the
+    next frame is read back into the other pix_data buffer.
+*/
+
+typedef struct {
+    //Render context of the rendition, with its own targets and readback ring (unused by the first rendition, which is the rendered one)
+    g2v_render_ctx ctx;
+    g2v_encoder encoder;
+    g2v_encoder proxy;
+    int* spare_pix_data;
+    size_t pix_data_size;
+
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t cond;
+    //The job of the worker: the state of the render context for a frame (or the end of the video if end_job)
+    g2v_render_ctx job;
+    int has_job, end_job, quit, failed;
+} ffmpeg_rendition;
+
+typedef struct {
+    ffmpeg_rendition* renditions;
+    int count;
+    //Render context of every rendition, those after the first one are the targets of downscale_target()
+    g2v_render_ctx* targets[G2V_MAX_RENDITIONS];
+} ffmpeg_ladder;
+
+int ffmpeg_rendition_worker(void* arg) {
+    ffmpeg_rendition* r = arg;
+    mtx_lock(&r->lock);
+    for(;;) {
+        while(!r->has_job && !r->quit) {
+            cnd_wait(&r->cond, &r->lock);
+        }
+        if(!r->has_job) {
+            break;
+        }
+        mtx_unlock(&r->lock);
+        int ok = r->end_job ? r->encoder.end_fn(&r->job, &r->encoder) : r->encoder.write_frame_fn(&r->job, &r->encoder);
+        mtx_lock(&r->lock);
+        if(!ok) {
+            r->failed = G2V_TRUE;
+        }
+        r->has_job = G2V_FALSE;
+        cnd_broadcast(&r->cond);
+    }
+    mtx_unlock(&r->lock);
+    return 0;
+}
+
+//Wait until the worker is idle, returns G2V_FALSE if any of its jobs failed
+int ffmpeg_rendition_wait(ffmpeg_rendition* r) {
+    mtx_lock(&r->lock);
+    while(r->has_job) {
+        cnd_wait(&r->cond, &r->lock);
+    }
+    int ok = !r->failed;
+    mtx_unlock(&r->lock);
+    return ok;
+}
+
+int ffmpeg_rendition_post(ffmpeg_rendition* r, const g2v_render_ctx* ctx, int end) {
+    if(!ffmpeg_rendition_wait(r)) {
+        return G2V_FALSE;
+    }
+    r->job = *ctx;
+    r->end_job = end;
+    mtx_lock(&r->lock);
+    r->has_job = G2V_TRUE;
+    cnd_broadcast(&r->cond);
+    mtx_unlock(&r->lock);
+    return G2V_TRUE;
+}
+
+int ffmpeg_rendition_write_frame(g2v_render_ctx* ctx, g2v_encoder* proxy) {
+    ffmpeg_rendition* r = proxy->internal_data;
+    if(!ffmpeg_rendition_post(r, ctx, G2V_FALSE)) {
+        return G2V_FALSE;
+    }
+    //The worker converts this frame from its buffer while the next one is mapped into the other. Duplicate and flat
+    //frames aren't read from pix_data, so they keep the buffer. pix_data still doesn't hold the previous frame after a
+    //swap, which is why map_gl_data() only skips the flip of frames reported as duplicates
+    if(ctx->pix_data_duplicate || ctx->pix_data_flat) {
+        return G2V_TRUE;
+    }
+    int* pix_data = ctx->pix_data;
+    ctx->pix_data = r->spare_pix_data;
+    r->spare_pix_data = pix_data;
+    return G2V_TRUE;
+}
+
+//Only queues the end of the video, the caller waits for it
+int ffmpeg_rendition_end(g2v_render_ctx* ctx, g2v_encoder* proxy) {
+    return ffmpeg_rendition_post(proxy->internal_data, ctx, G2V_TRUE);
+}
+
+int ffmpeg_init_rendition(ffmpeg_rendition* r, g2v_render_ctx* ctx, const g2v_rendition* desc, int own_ctx) {
+    g2v_render_ctx* rctx = ctx;
+    if(own_ctx) {
+        g2v_render_options ropts;
+        g2v_render_default_options(&ropts, desc->width, desc->height);
+        ropts.targets = ctx->targets;
+        if(!g2v_init_render_ctx_ex(&r->ctx, &ropts)) {
+            return G2V_FALSE;
+        }
+        rctx = &r->ctx;
+    }
+    r->pix_data_size = sizeof(int) * rctx->width * rctx->height;
+    r->spare_pix_data = g2v_alloc_buffer(r->pix_data_size);
+    if(!r->spare_pix_data) {
+        err_printf("Could not allocate pixel buffer");
+        goto fail1;
+    }
+    if(!g2v_create_ffmpeg_encoder_ex(&r->encoder, rctx, &desc->ffmpeg)) {
+        goto fail2;
+    }
+
+    memset(&r->proxy, 0, sizeof r->proxy);
+    r->proxy.internal_data = r;
+    r->proxy.write_frame_fn = ffmpeg_rendition_write_frame;
+    r->proxy.end_fn = ffmpeg_rendition_end;
+    r->has_job = r->end_job = r->quit = r->failed = G2V_FALSE;
+    mtx_init(&r->lock, mtx_plain);
+    cnd_init(&r->cond);
+    if(thrd_create(&r->thread, ffmpeg_rendition_worker, r) != thrd_success) {
+        err_printf("Could not create encoder thread");
+        goto fail3;
+    }
+    return G2V_TRUE;
+
+fail3:
+    mtx_destroy(&r->lock);
+    cnd_destroy(&r->cond);
+    g2v_finish_ffmpeg_encoder(&r->encoder);
+fail2:
+    g2v_free_buffer(r->spare_pix_data, r->pix_data_size);
+fail1:
+    if(own_ctx) {
+        g2v_free_render_ctx(&r->ctx);
+    }
+    return G2V_FALSE;
+}
+
+int ffmpeg_free_rendition(ffmpeg_rendition* r, int own_ctx) {
+    mtx_lock(&r->lock);
+    r->quit = G2V_TRUE;
+    cnd_broadcast(&r->cond);
+    mtx_unlock(&r->lock);
+    thrd_join(r->thread, NULL);
+    mtx_destroy(&r->lock);
+    cnd_destroy(&r->cond);
+
+    int ret = g2v_finish_ffmpeg_encoder(&r->encoder);
+    g2v_free_buffer(r->spare_pix_data, r->pix_data_size);
+    if(own_ctx) {
+        g2v_free_render_ctx(&r->ctx);
+    }
+    return ret;
+}
+
+int ffmpeg_ladder_write_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_ladder* ladder = encoder->internal_data;
+    return ffmpeg_rendition_write_frame(ctx, &ladder->renditions[0].proxy);
+}
+
+//Downscale the frame just submitted into every other rendition, and queue their readback
+int ffmpeg_ladder_submit_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_ladder* ladder = encoder->internal_data;
+    int idx = (ctx->current_frame_index - 1) % ctx->targets;
+    g2v_encoder* top = &ladder->renditions[0].encoder;
+    if(top->submit_frame_fn && !top->submit_frame_fn(ctx, top)) {
+        return G2V_FALSE;
+    }
+    for(int i = 1; i < ladder->count; i++) {
+        ffmpeg_rendition* r = &ladder->renditions[i];
+        if(!g2v_begin_frame(&r->proxy, &r->ctx)) {
+            return G2V_FALSE;
+        }
+        if(ctx->frame_unchanged[idx]) {
+            g2v_mark_frame_unchanged(&r->ctx);
+        }
+    }
+    if(!ctx->frame_unchanged[idx]) {
+        downscale_target(ctx, idx, ladder->targets + 1, ladder->count - 1);
+    }
+    for(int i = 1; i < ladder->count; i++) {
+        ffmpeg_rendition* r = &ladder->renditions[i];
+        if(!g2v_submit_frame(&r->proxy, &r->ctx) || g2v_poll(&r->proxy, &r->ctx) < 0) {
+            return G2V_FALSE;
+        }
+    }
+    return G2V_TRUE;
+}
+
+int ffmpeg_ladder_end(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    ffmpeg_ladder* ladder = encoder->internal_data;
+    int ret = ffmpeg_rendition_end(ctx, &ladder->renditions[0].proxy);
+    for(int i = 1; i < ladder->count; i++) {
+        ffmpeg_rendition* r = &ladder->renditions[i];
+        if(!g2v_end_frames(&r->proxy, &r->ctx)) {
+            ret = G2V_FALSE;
+        }
+    }
+    //All renditions flush their encoder at the same time
+    for(int i = 0; i < ladder->count; i++) {
+        if(!ffmpeg_rendition_wait(&ladder->renditions[i])) {
+            ret = G2V_FALSE;
+        }
+    }
+    return ret;
+}
 
+int g2v_create_ffmpeg_ladder_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_rendition* renditions, int count) {
+    if(count < 1 || count > G2V_MAX_RENDITIONS) {
+        err_printf("Invalid number of renditions: %d", count);
+        return G2V_FALSE;
+    }
+    if(is_tiled(ctx) || ctx->track_damage) {
+        //pix_data alternates between two buffers, so it can't be patched with the damage of the next frame
+        err_printf("Ladder encoders can't be combined with tiling or track_damage");
+        return G2V_FALSE;
+    }
+    for(int i = 0; i < count; i++) {
+        const g2v_rendition* r = &renditions[i];
+        int top = i == 0 && ((r->width == 0 && r->height == 0) || (r->width == ctx->width && r->height == ctx->height));
+        if(i == 0 ? !top : r->width <= 0 || r->height <= 0 || r->width > ctx->width || r->height > ctx->height) {
+            err_printf("Invalid rendition %d of %dx%d for a render context of %dx%d", i, r->width, r->height, ctx->width, ctx->height);
+            return G2V_FALSE;
+        }
+        if(r->ffmpeg.fps != renditions[0].ffmpeg.fps || r->ffmpeg.segment_frames > 0) {
+            err_printf("Rendition %d must have the same fps as the others, and no segments", i);
+            return G2V_FALSE;
+        }
+    }
+    if(count > 1 && !init_downscale_source(ctx)) {
+        return G2V_FALSE;
+    }
 
+    ffmpeg_ladder* ladder = g2v_calloc(1, sizeof *ladder);
+    if(ladder) {
+        ladder->renditions = g2v_calloc(count, sizeof *ladder->renditions);
+    }
+    if(!ladder || !ladder->renditions) {
+        err_printf("Could not allocate renditions");
+        g2v_free(ladder);
+        return G2V_FALSE;
+    }
+    for(; ladder->count < count; ladder->count++) {
+        int i = ladder->count;
+        if(!ffmpeg_init_rendition(&ladder->renditions[i], ctx, &renditions[i], i > 0)) {
+            goto fail;
+        }
+        ladder->targets[i] = i > 0 ? &ladder->renditions[i].ctx : ctx;
+    }
 
+    enc->internal_data = ladder;
+    enc->encode_fn = pipeline_encode;
+    enc->write_frame_fn = ffmpeg_ladder_write_frame;
+    enc->submit_frame_fn = ffmpeg_ladder_submit_frame;
+    enc->end_fn = ffmpeg_ladder_end;
     return G2V_TRUE;
+
+fail:
+    for(int i = 0; i < ladder->count; i++) {
+        ffmpeg_free_rendition(&ladder->renditions[i], i > 0);
+    }
+    g2v_free(ladder->renditions);
+    g2v_free(ladder);
+    return G2V_FALSE;
+}
+
+int g2v_finish_ffmpeg_ladder_encoder(g2v_encoder* enc) {
+    ffmpeg_ladder* ladder = enc->internal_data;
+    int ret = G2V_TRUE;
+    for(int i = 0; i < ladder->count; i++) {
+        if(!ffmpeg_free_rendition(&ladder->renditions[i], i > 0)) {
+            ret = G2V_FALSE;
+        }
+    }
+    g2v_free(ladder->renditions);
+    g2v_free(ladder);
+    enc->internal_data = NULL;
+    return ret;
+}
+
+/*
+    Transcoding: decodes a file (e.g. an intermediate capture) and encodes it again through the same output path as the encoder
+*/
+
+int ffmpeg_transcode_frame(ffmpeg_internals* fi, AVFrame* decoded, AVRational time_base) {
+    int64_t pts = decoded->best_effort_timestamp;
+    pts = pts == AV_NOPTS_VALUE ? fi->video.next_pts : av_rescale_q(pts, time_base, (AVRational) { 1, fi->fps });
+    //With an input rate above fps, frames can round to a timestamp already written, they are dropped
+    if(pts < fi->video.next_pts) {
+        av_frame_unref(decoded);
+        return G2V_TRUE;
+    }
+    AVFrame* frame = decoded;
+    if(fi->direct) {
+        //Same layout, e.g. BGRA decoded and BGR0 encoded
+        frame->format = fi->pix_fmt;
+    } else {
+        if(av_frame_make_writable(fi->video.frame) < 0) {
+            err_printf("Could not make frame writable");
+            return G2V_FALSE;
+        }
+        double start = stage_clock();
+        sws_scale(fi->sws_ctx, (const uint8_t* const*)decoded->data, decoded->linesize, 0, fi->height, fi->video.frame->data, fi->video.frame->linesize);
+        record_stage(fi->timings, G2V_STAGE_CONVERT, stage_clock() - start);
+        frame = fi->video.frame;
+    }
+    frame->pts = pts;
+    fi->video.next_pts = pts + 1;
+    int ret = ffmpeg_write_frame(fi, &fi->video, frame);
+    av_frame_unref(decoded);
+    return ret != G2V_FALSE;
+}
+
+//Hand a packet (NULL to drain) to the decoder, and every frame it returns to the encoder
+int ffmpeg_transcode_packet(ffmpeg_internals* fi, AVCodecContext* dec, AVPacket* pkt, AVFrame* decoded, AVRational time_base) {
+    if(avcodec_send_packet(dec, pkt) < 0) {
+        err_printf("Error sending packet to the decoder");
+        return G2V_FALSE;
+    }
+    for(;;) {
+        int ret = avcodec_receive_frame(dec, decoded);
+        if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+            return G2V_TRUE;
+        } else if(ret < 0) {
+            err_printf("Error decoding frame");
+            return G2V_FALSE;
+        }
+        if(!ffmpeg_transcode_frame(fi, decoded, time_base)) {
+            return G2V_FALSE;
+        }
+    }
+}
+
+int g2v_transcode(const char* input_file, const g2v_ffmpeg_options* opts) {
+    int ret = G2V_FALSE;
+    AVFormatContext* input_ctx = NULL;
+    AVCodecContext* dec = NULL;
+    AVPacket* pkt = NULL;
+    AVFrame* decoded = NULL;
+    ffmpeg_internals* fi = g2v_calloc(1, sizeof *fi);
+    if(!fi || !(fi->timings = alloc_timings())) {
+        err_printf("Could not allocate transcoder");
+        goto fail1;
+    }
+
+    if(avformat_open_input(&input_ctx, input_file, NULL, NULL) < 0) {
+        err_printf("Could not open file: %s", input_file);
+        goto fail1;
+    }
+    if(avformat_find_stream_info(input_ctx, NULL) < 0) {
+        err_printf("Could not read stream info of %s", input_file);
+        goto fail2;
+    }
+    int stream_index = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if(stream_index < 0) {
+        err_printf("No video stream in %s", input_file);
+        goto fail2;
+    }
+    AVStream* in_stream = input_ctx->streams[stream_index];
+    AVCodec* decoder = avcodec_find_decoder(in_stream->codecpar->codec_id);
+    dec = decoder ? avcodec_alloc_context3(decoder) : NULL;
+    if(!dec || avcodec_parameters_to_context(dec, in_stream->codecpar) < 0) {
+        err_printf("Decoder not found");
+        goto fail2;
+    }
+    //Slices of intermediates (FFV1, Ut Video) are decoded in parallel
+    dec->thread_count = 0;
+    if(avcodec_open2(dec, decoder, NULL) < 0) {
+        err_printf("Could not open decoder");
+        goto fail2;
+    }
+
+    fi->width = dec->width;
+    fi->height = dec->height;
+    fi->fps = opts->fps;
+    fi->output_file = copy_string(opts->output_file);
+    fi->codec_name = opts->codec_name ? copy_string(opts->codec_name) : NULL;
+    fi->preset = opts->preset ? copy_string(opts->preset) : NULL;
+    fi->codec_options = opts->codec_options ? copy_string(opts->codec_options) : NULL;
+    fi->src_fmt = dec->pix_fmt;
+    fi->pix_fmt = opts->rgb_direct ? ffmpeg_negotiate_pix_fmt(fi) : AV_PIX_FMT_YUV420P;
+    fi->direct = fi->pix_fmt == fi->src_fmt || (fi->src_fmt == AV_PIX_FMT_BGRA && fi->pix_fmt == AV_PIX_FMT_BGR0);
+    fi->dropped_frame_index = -1;
+
+    fi->packet = av_packet_alloc();
+    fi->video.frame = av_frame_alloc();
+    pkt = av_packet_alloc();
+    decoded = av_frame_alloc();
+    if(!fi->packet || !fi->video.frame || !pkt || !decoded) {
+        err_printf("Could not allocate frame");
+        goto fail2;
+    }
+    if(!fi->direct) {
+        fi->video.frame->width = fi->width;
+        fi->video.frame->height = fi->height;
+        fi->video.frame->format = fi->pix_fmt;
+        fi->sws_ctx = sws_getContext(fi->width, fi->height, fi->src_fmt, fi->width, fi->height, fi->pix_fmt, opts->sws_flags, NULL, NULL, NULL);
+        if(!fi->sws_ctx || !ffmpeg_alloc_frame_buffer(fi->video.frame)) {
+            err_printf("Could not allocate conversion");
+            goto fail2;
+        }
+    }
+
+    if(!ffmpeg_open_output(fi, opts->output_file)) {
+        goto fail2;
+    }
+    int ok = G2V_TRUE;
+    while(ok && av_read_frame(input_ctx, pkt) >= 0) {
+        if(pkt->stream_index == stream_index) {
+            ok = ffmpeg_transcode_packet(fi, dec, pkt, decoded, in_stream->time_base);
+        }
+        av_packet_unref(pkt);
+    }
+    if(ok) {
+        ok = ffmpeg_transcode_packet(fi, dec, NULL, decoded, in_stream->time_base);
+    }
+    if(ok) {
+        int written;
+        while((written = ffmpeg_write_frame(fi, &fi->video, NULL)) == G2V_TRUE);
+        ok = written == G2V_EOF;
+    }
+    ret = ffmpeg_close_output(fi) && ok;
+
+fail2:
+    av_frame_free(&decoded);
+    av_packet_free(&pkt);
+    av_frame_free(&fi->video.frame);
+    av_packet_free(&fi->packet);
+    av_buffer_pool_uninit(&fi->packet_pool);
+    sws_freeContext(fi->sws_ctx);
+    avcodec_free_context(&dec);
+    avformat_close_input(&input_ctx);
+    g2v_free(fi->codec_name);
+    g2v_free(fi->preset);
+    g2v_free(fi->codec_options);
+    g2v_free(fi->output_file);
+fail1:
+    if(fi) {
+        free_timings(fi->timings);
+    }
+    g2v_free(fi);
+    return ret;
+}
+
+//Not supported
+int g2v_init_ffmpeg_audio_stream(g2v_encoder* enc) {
+    return G2V_FALSE;
+}
+
+int g2v_finish_ffmpeg_encoder(g2v_encoder* enc) {
+    ffmpeg_internals* fi = enc->internal_data;
+    int ret = G2V_TRUE;
+
+    if(fi->segment_frames > 0 && !fi->ended) {
+        //The render didn't complete: the journal and the completed segments are kept for resuming,
+        //and the open segment (not in the journal) is removed, it is encoded again on resume
+        if(fi->output_ctx) {
+            ffmpeg_close_output(fi);
+            char* filename = ffmpeg_segment_filename(fi->output_file, fi->segment_index);
+            remove(filename);
+            g2v_free(filename);
+        }
+        err_printf("Render incomplete, segments kept in %s for resuming", fi->journal_file);
+        ret = G2V_FALSE;
+    } else if(fi->output_ctx) {
+        ret = ffmpeg_close_output(fi);
+    }
+    if(fi->segment_frames > 0 && fi->ended && ret) {
+        ret = ffmpeg_concat_segments(fi);
+        if(ret) {
+            for(int i = 0; i < fi->segment_count; i++) {
+                char* filename = ffmpeg_segment_filename(fi->output_file, i);
+                remove(filename);
+                g2v_free(filename);
+            }
+            remove(fi->journal_file);
+        }
+    }
+
+    finish_preview(&fi->preview);
+    sws_freeContext(fi->sws_ctx);
+    sws_freeContext(fi->tail_sws_ctx);
+    av_frame_free(&fi->video.frame);
+    av_packet_free(&fi->packet);
+    av_buffer_pool_uninit(&fi->packet_pool);
+    g2v_free_buffer(fi->flat_pixels, sizeof(int) * fi->width * fi->height);
+    g2v_free(fi->codec_name);
+    g2v_free(fi->preset);
+    g2v_free(fi->codec_options);
+    g2v_free(fi->journal_file);
+    g2v_free(fi->output_file);
+    g2v_free(fi);
+    enc->internal_data = NULL;
+
+    return ret;
 }
 
 #endif
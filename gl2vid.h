@@ -54,159 +54,1234 @@ int g2v_create_context();
  */
 void g2v_free_context();
 
+/**
+ * @brief Default number of render targets (and PBOs) in flight, see g2v_render_options
+ * 
+ */
 #define G2V_TARGETS 2
+#define G2V_MAX_TARGETS 8
 #define G2V_TARGET_RENDERBUFFER
 
 /**
- * @brief gl2vid render context, which contains all OpenGL objects needed to render offscreen
+ * @brief Maximum number of damaged rectangles per frame, see g2v_add_damage()
+ * 
+ */
+#define G2V_MAX_DAMAGE_RECTS 16
+
+/**
+ * @brief Layout of the pixels read back into pix_data, see g2v_render_options.pixel_format
+ * 
+ */
+typedef enum {
+    G2V_PIXELS_BGRA, /**< packed BGRA, 4 bytes per pixel */
+    G2V_PIXELS_GBRP, /**< planar: width x height bytes of green, then of blue, then of red, separated on the GPU */
+} g2v_pixel_format;
+
+/**
+ * @brief A rectangle in framebuffer coordinates (origin at the bottom left, like glViewport())
+ * 
+ */
+typedef struct {
+    int x, y, width, height;
+} g2v_rect;
+
+/**
+ * @brief Pipeline stages timed by gl2vid, see g2v_get_stats()
+ * 
+ */
+typedef enum {
+    G2V_STAGE_RENDER,   /**< CPU time between g2v_begin_frame() and g2v_submit_frame(), i.e. render_video_frame */
+    G2V_STAGE_MAP_WAIT, /**< waiting for the readback to complete and mapping the PBO (per tile, in tiled mode) */
+    G2V_STAGE_FLIP,     /**< flipping rows from the PBO into pix_data (and hashing them, with detect_duplicates; per tile, in tiled mode) */
+    G2V_STAGE_CONVERT,  /**< pixel format conversion (sws_scale), or the copy into the encoder frame with rgb_direct */
+    G2V_STAGE_ENCODE,   /**< avcodec_send_frame/avcodec_receive_packet */
+    G2V_STAGE_MUX,      /**< writing packets to the output */
+    G2V_STAGE_GPU_RENDER,   /**< GPU time of the commands issued between g2v_begin_frame() and g2v_submit_frame() (needs GL_ARB_timer_query) */
+    G2V_STAGE_GPU_READBACK, /**< GPU time of glReadPixels into the PBO, or of the flat frame detection if enabled (needs GL_ARB_timer_query) */
+    G2V_STAGE_COUNT
+} g2v_stage;
+
+/**
+ * @brief Number of most recent frames the percentiles of g2v_stage_stats are computed from
+ * 
+ */
+#define G2V_STATS_WINDOW 1024
+
+/**
+ * @brief Per-frame timings of one pipeline stage, in seconds
+ * 
+ */
+typedef struct {
+    /**
+     * @brief Number of frames recorded since the render context was initialized (or the stats were reset)
+     * 
+     */
+    int count;
+
+    /**
+     * @brief Total time spent in this stage over all recorded frames
+     * 
+     */
+    double total;
+
+    /**
+     * @brief Percentiles and maximum over the last G2V_STATS_WINDOW recorded frames
+     * 
+     */
+    double p50, p95, p99, max;
+} g2v_stage_stats;
+
+/**
+ * @brief Timing statistics of a render context, see g2v_get_stats()
+ * 
+ */
+typedef struct {
+    /**
+     * @brief Timings of every stage, indexed by g2v_stage
+     * 
+     */
+    g2v_stage_stats stages[G2V_STAGE_COUNT];
+
+    /**
+     * @brief Number of frames detected as a single colour, which skipped the full readback (see g2v_render_options.detect_flat)
+     * 
+     */
+    int flat_frames;
+
+    /**
+     * @brief Number of frames identical to the previous one (see g2v_render_options.detect_duplicates)
+     * 
+     */
+    int duplicate_frames;
+
+    /**
+     * @brief Number of frames of which only the damaged rectangles were read back (see g2v_add_damage())
+     * 
+     */
+    int partial_frames;
+
+    /**
+     * @brief Total number of bytes read back from the GPU
+     * 
+     */
+    unsigned long long readback_bytes;
+} g2v_stats;
+
+/**
+ * @brief Opaque per-stage timing storage of a render context
+ * 
+ */
+typedef struct g2v_timings g2v_timings;
+
+/**
+ * @brief Opaque OpenGL state of the shader passes gl2vid runs on rendered frames (e.g. flat frame detection)
+ * 
+ */
+typedef struct g2v_passes g2v_passes;
+
+/**
+ * @brief gl2vid render context, which contains all OpenGL objects needed to render offscreen
+ * 
+ */
+typedef struct {
+    /**
+     * @brief Video frame dimensions
+     * 
+     */
+    int width, height;
+
+    /**
+     * @brief Number of render targets (and PBOs) in use, i.e. the maximum number of frames (or tiles) in flight
+     * 
+     */
+    int targets;
+
+    /**
+     * @brief Size of the render targets, and number of tiles per frame (1 x 1 unless tiled, see g2v_render_options.tile_width)
+     * 
+     */
+    int tile_width, tile_height, tiles_x, tiles_y;
+
+    /**
+     * @brief Size of the image frames are rendered at, larger than width x height when supersampling (see g2v_render_options.render_width)
+     * 
+     */
+    int render_width, render_height;
+
+    /**
+     * @brief Layout of pix_data, see g2v_render_options.pixel_format
+     * 
+     */
+    g2v_pixel_format pixel_format;
+
+    /**
+     * @brief Number of sub-frames accumulated per frame, 1 without accumulation (see g2v_render_options.accumulate)
+     * 
+     */
+    int accumulate;
+
+    /**
+     * @brief Index of the sub-frame being rendered, from 0 to accumulate - 1
+     * 
+     */
+    int accumulate_index;
+
+    /**
+     * @brief Number of samples per pixel of msaa_renderbuffer, 0 without multisampling
+     * 
+     */
+    int samples;
+
+    /**
+     * @brief Multisampled framebuffer frames (or tiles) are rendered into when samples is set, resolved into framebuffers[] at submit
+     * 
+     */
+    GLuint msaa_framebuffer, msaa_renderbuffer;
+
+    /**
+     * @brief Tile currently being rendered, in frame pixels (the whole frame unless tiled)
+     * 
+     * The render target only covers this tile, so the rendering must be offset, e.g. with g2v_get_tile_matrix().
+     * 
+     */
+    g2v_rect tile;
+
+    /**
+     * @brief Index of the tile currently being rendered within its frame, see g2v_next_tile()
+     * 
+     */
+    int tile_index;
+
+    /**
+     * @brief Tiled mode: number of tiles submitted since the render context was initialized, and of those whose pixels have not reached pix_data yet
+     * 
+     */
+    int submitted_tiles, pending_tiles;
+
+    /**
+     * @brief Tiled mode: frame index and tile index held by every target
+     * 
+     */
+    int target_frame[G2V_MAX_TARGETS], target_tile[G2V_MAX_TARGETS];
+
+    /**
+     * @brief Current frame index, starts from 0
+     * 
+     */
+    int current_frame_index;
+
+    /**
+     * @brief Framebuffers for all rendering works to be rendered on
+     * 
+     */
+    GLuint framebuffers[G2V_MAX_TARGETS];
+#ifdef G2V_TARGET_RENDERBUFFER
+    /**
+     * @brief Renderbuffer attachment for framebuffers
+     * 
+     */
+    GLuint renderbuffers[G2V_MAX_TARGETS];
+#else
+    /**
+     * @brief Texture attachment for framebuffers
+     * 
+     */
+    GLuint textures[G2V_MAX_TARGETS];
+#endif
+
+    /**
+     * @brief Pixel buffer objects for speeding up CPU-GPU pixels transfer
+     * 
+     */
+    GLuint pbos[G2V_MAX_TARGETS];
+
+    /**
+     * @brief Fences signaled when the readback into the corresponding PBO completes (NULL if none is pending, or if GL_ARB_sync is not supported)
+     * 
+     */
+    GLsync fences[G2V_MAX_TARGETS];
+
+    /**
+     * @brief GL_TIMESTAMP queries of every target, taken before rendering, before readback and after readback
+     * 
+     * They are read together with the PBO of the same target, when the results are already available, so they never stall.
+     * All zero if GL_ARB_timer_query is not supported.
+     * 
+     */
+    GLuint timestamp_queries[G2V_MAX_TARGETS][3];
+
+    /**
+     * @brief Current pixel data, rows from top to bottom, in BGRA (for better alignment, and maybe transparency support in the future)
+     * 
+     * With G2V_PIXELS_GBRP, the first 3 x width x height bytes hold the three planes instead.
+     * 
+     */
+    int* pix_data;
+
+    /**
+     * @brief Number of frames whose readback has been issued but whose pixels have not reached pix_data yet
+     * 
+     */
+    int pending_frames;
+
+    /**
+     * @brief Index of the frame currently stored in pix_data (the readback lags behind current_frame_index)
+     * 
+     */
+    int pix_data_frame_index;
+
+    /**
+     * @brief G2V_TRUE if the current frame was detected as a single colour, G2V_FALSE otherwise
+     * 
+     * In that case pix_data is NOT updated, and every pixel of the frame has the value pix_data_flat_color.
+     * Only ever set if the render context was initialized with detect_flat.
+     * 
+     */
+    int pix_data_flat;
+
+    /**
+     * @brief Colour of the current frame if pix_data_flat is set, in the same format as pix_data
+     * 
+     */
+    int pix_data_flat_color;
+
+    /**
+     * @brief Frames marked with g2v_mark_frame_unchanged(), per target
+     * 
+     */
+    int frame_unchanged[G2V_MAX_TARGETS];
+
+    /**
+     * @brief Whether damaged rectangles are tracked, see g2v_render_options.track_damage
+     * 
+     */
+    int track_damage;
+
+    /**
+     * @brief Damaged rectangles reported with g2v_add_damage(), per target
+     * 
+     */
+    g2v_rect damage[G2V_MAX_TARGETS][G2V_MAX_DAMAGE_RECTS];
+
+    /**
+     * @brief Number of damaged rectangles per target, 0 if the whole frame is read back (nothing reported, or too many rectangles)
+     * 
+     */
+    int damage_count[G2V_MAX_TARGETS];
+
+    /**
+     * @brief Rows of pix_data (from the top, y1 excluded) which differ from the previous frame, the whole frame unless damage was reported
+     * 
+     */
+    int pix_data_dirty_y0, pix_data_dirty_y1;
+
+    /**
+     * @brief Whether frames are hashed to detect duplicates, see g2v_render_options.detect_duplicates
+     * 
+     */
+    int detect_duplicates;
+
+    /**
+     * @brief Hash of the pixels in pix_data (see g2v_hash_frame()), 0 if unknown
+     * 
+     */
+    unsigned long long pix_data_hash;
+
+    /**
+     * @brief G2V_TRUE if the current frame is identical to the previous one (as far as a 64-bit hash can tell), G2V_FALSE otherwise
+     * 
+     * Only ever set with detect_duplicates, or for frames marked with g2v_mark_frame_unchanged().
+     * 
+     */
+    int pix_data_duplicate;
+
+    /**
+     * @brief Per-stage timings recorded by the pipeline and the encoder, see g2v_get_stats()
+     * 
+     */
+    g2v_timings* timings;
+
+    /**
+     * @brief Shader passes run on every frame, NULL if none is enabled
+     * 
+     */
+    g2v_passes* passes;
+} g2v_render_ctx;
+
+/**
+ * @brief Initialize a allocated gl2vid render context
+ * 
+ * @param ctx pointer to the allocated render context
+ * @param width width of new video frame
+ * @param height height of new video frame
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_init_render_ctx(g2v_render_ctx* ctx, int width, int height);
+
+/**
+ * @brief Post-process effects, applied on the GPU to every frame before readback (see g2v_render_options.effects)
+ * 
+ */
+typedef enum {
+    G2V_EFFECT_LUT,     /**< color grading with a 3D lookup table */
+    G2V_EFFECT_OVERLAY, /**< alpha blending of a static image, e.g. a watermark */
+    G2V_EFFECT_CROP,    /**< crop to a rectangle (padded where it leaves the frame), stretched to the whole frame */
+    G2V_EFFECT_SCALE,   /**< scale the whole frame into a rectangle, padding around it (letterboxing) */
+} g2v_effect_type;
+
+/**
+ * @brief One post-process effect. Only the fields of its type are used, and the data is copied to the GPU by g2v_init_render_ctx_ex()
+ * 
+ */
+typedef struct {
+    g2v_effect_type type;
+
+    /**
+     * @brief Overlay: where the image is drawn (stretched to fit). Crop: the part of the frame kept. Scale: where the frame is drawn.
+     * 
+     */
+    g2v_rect rect;
+
+    /**
+     * @brief LUT: lut_size^3 RGB entries in [0, 1], red varying fastest (the order of .cube files)
+     * 
+     */
+    const float* lut;
+    int lut_size;
+
+    /**
+     * @brief Overlay: image_width x image_height BGRA pixels (like pix_data, rows from top to bottom) with straight alpha
+     * 
+     */
+    const unsigned char* image;
+    int image_width, image_height;
+
+    /**
+     * @brief Overlay: multiplied with the alpha of the image
+     * 
+     */
+    float opacity;
+
+    /**
+     * @brief Crop, scale: color of the padding, as 0xRRGGBB
+     * 
+     */
+    int pad_color;
+} g2v_effect;
+
+/**
+ * @brief Options of a render context, used by g2v_init_render_ctx_ex()
+ * 
+ * Always initialize this with g2v_render_default_options() before changing any field,
+ * so that fields added in the future get sensible values.
+ * 
+ */
+typedef struct {
+    /**
+     * @brief Video frame dimensions
+     * 
+     */
+    int width, height;
+
+    /**
+     * @brief Number of render targets (and PBOs), from 2 to G2V_MAX_TARGETS, G2V_TARGETS by default
+     * 
+     * More targets let the GPU run further ahead of the readback, at the cost of latency and video memory.
+     * 
+     */
+    int targets;
+
+    /**
+     * @brief Detect frames of a single colour on the GPU, G2V_FALSE by default
+     * 
+     * A reduction shader pass runs after every frame, and only a single pixel of uniform frames is read back (see pix_data_flat).
+     * Frames with any other content are read back in full one poll later, once the result of the detection is known.
+     * Needs GLSL 1.30 (OpenGL 3.0).
+     * 
+     */
+    int detect_flat;
+
+    /**
+     * @brief Hash every read back frame and compare it with the previous one, G2V_FALSE by default
+     * 
+     * Identical frames skip the row flip and are marked with pix_data_duplicate, so that encoders can skip the conversion too.
+     * 
+     */
+    int detect_duplicates;
+
+    /**
+     * @brief Let the render callback report damaged rectangles with g2v_add_damage(), G2V_FALSE by default
+     * 
+     * Frames with reported damage only read back these rectangles and patch them into pix_data, which keeps the previous frame,
+     * and encoders only convert the rows they cover (see pix_data_dirty_y0).
+     * 
+     */
+    int track_damage;
+
+    /**
+     * @brief Size of the tiles a frame is rendered in, 0 (the default) only tiles frames larger than the OpenGL limits
+     * 
+     * Frames larger than a tile are rendered as a grid of tiles (left to right, bottom to top), each one rendered
+     * separately into a tile sized target (see g2v_render_ctx.tile and g2v_get_tile_matrix()) and read back while the next
+     * one renders. This allows frames larger than GL_MAX_RENDERBUFFER_SIZE/GL_MAX_TEXTURE_SIZE, and saves video memory.
+     * Tiling can't be combined with detect_flat, detect_duplicates or track_damage, and ignores g2v_mark_frame_unchanged().
+     * 
+     */
+    int tile_width, tile_height;
+
+    /**
+     * @brief Number of samples per pixel, 0 or 1 (the default) for no multisampling
+     * 
+     * Frames are rendered into a multisampled renderbuffer, which is resolved on the GPU into the render target at
+     * g2v_submit_frame(), so only resolved pixels are read back. Clamped to GL_MAX_SAMPLES.
+     * 
+     */
+    int samples;
+
+    /**
+     * @brief Internal resolution frames are rendered at, 0 (the default) for the video frame dimensions
+     * 
+     * When larger than width x height, frames are supersampled: rendered at this resolution, then downscaled on the GPU
+     * with a box filter (averaging every source pixel a video pixel covers) before readback. Integer factors (e.g. 2x, 4x)
+     * give an exact box filter. Can't be combined with tiling.
+     * 
+     */
+    int render_width, render_height;
+
+    /**
+     * @brief Number of sub-frames averaged into every video frame (temporal supersampling, motion blur), 0 or 1 to disable
+     * 
+     * render_video_frame is called that many times per frame, at the times given by g2v_get_subframe_offset(), and the
+     * sub-frames are accumulated in a floating point target on the GPU. Only the average is read back and encoded, so readback
+     * and encoding cost the same as without accumulation. Can't be combined with tiling.
+     * 
+     */
+    int accumulate;
+
+    /**
+     * @brief Post-process effects applied in order to every frame, after supersampling and accumulation, before readback
+     * 
+     * Each effect is a fullscreen shader pass between two ping-pong targets, the last one writing the render target,
+     * so frames are still read back once. The array is only read by g2v_init_render_ctx_ex().
+     * Effects can't be combined with tiling or track_damage.
+     * 
+     */
+    const g2v_effect* effects;
+    int effect_count;
+
+    /**
+     * @brief Layout of the pixels read back into pix_data, G2V_PIXELS_BGRA by default
+     * 
+     * With G2V_PIXELS_GBRP, a shader pass writes the G, B and R planes of every frame into three render targets at once,
+     * which are read back one after the other, so encoders for codecs taking planar RGB (e.g. utvideo, FFV1) don't convert
+     * anything (see g2v_ffmpeg_options.rgb_direct). Only the ffmpeg encoders accept such render contexts.
+     * Can't be combined with tiling, detect_flat or track_damage.
+     * 
+     */
+    g2v_pixel_format pixel_format;
+} g2v_render_options;
+
+/**
+ * @brief Fill an options struct with the default render context options
+ * 
+ * @param opts pointer to the options to be initialized
+ * @param width width of new video frame
+ * @param height height of new video frame
+ */
+void g2v_render_default_options(g2v_render_options* opts, int width, int height);
+
+/**
+ * @brief Initialize a allocated gl2vid render context with the specified options
+ * 
+ * @param ctx pointer to the allocated render context
+ * @param opts pointer to render options, initialized with g2v_render_default_options()
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_init_render_ctx_ex(g2v_render_ctx* ctx, const g2v_render_options* opts);
+
+/**
+ * @brief Deinit the allocated gl2vid render context
+ * 
+ * @param ctx pointer to the render context to be deinited
+ */
+void g2v_free_render_ctx(g2v_render_ctx* ctx);
+
+/**
+ * @brief Get the timing statistics of the frames processed by a render context and its encoder
+ * 
+ * This is cheap enough to be called every few seconds during encoding, e.g. to print progress.
+ * 
+ * @param ctx pointer to initialized gl2vid render context
+ * @param stats pointer to the stats to be filled
+ */
+void g2v_get_stats(const g2v_render_ctx* ctx, g2v_stats* stats);
+
+/**
+ * @brief Clear the timings recorded so far, e.g. to exclude warm-up frames
+ * 
+ * @param ctx pointer to initialized gl2vid render context
+ */
+void g2v_reset_stats(g2v_render_ctx* ctx);
+
+/**
+ * @brief Get a short human-readable name of a pipeline stage
+ * 
+ * @param stage the pipeline stage
+ * @return the stage name, e.g. "convert"
+ */
+const char* g2v_stage_name(g2v_stage stage);
+
+/**
+ * @brief Start recording pipeline events for a Chrome trace-event JSON file, which can be opened in Perfetto or chrome://tracing
+ * 
+ * Every pipeline stage (render, readback, map, flip, convert, encode, mux) is recorded as a span on the thread
+ * it runs on, GPU render/readback times (if GL_ARB_timer_query is supported) on a separate GPU track, and the
+ * number of frames in flight as a counter. Each thread keeps its most recent 65536 events.
+ * 
+ * @param output_file the JSON file written by g2v_finish_trace()
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_start_trace(const char* output_file);
+
+/**
+ * @brief Stop recording pipeline events and write the trace file
+ * 
+ * This must be called while no frame is being processed, e.g. after g2v_encode() returned.
+ * 
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_finish_trace();
+
+/**
+ * @brief Abstract interface of a gl2vid video encoder
+ * 
+ */
+struct g2v_encoder {
+    /**
+     * @brief Internal data, depends on the encoder type
+     * 
+     */
+    void* internal_data;
+
+    /**
+     * @brief Encode function, depends on the encoder type
+     * 
+     */
+    int(*encode_fn)(g2v_render_ctx*, struct g2v_encoder*);
+
+    /**
+     * @brief Frame function, depends on the encoder type. Called by the pipeline with a completed frame in the pix_data of the render context.
+     * 
+     */
+    int(*write_frame_fn)(g2v_render_ctx*, struct g2v_encoder*);
+
+    /**
+     * @brief Submit function, depends on the encoder type (may be NULL). Called by g2v_submit_frame() once the readback of a frame is queued,
+     * while its final image is still in its render target.
+     * 
+     */
+    int(*submit_frame_fn)(g2v_render_ctx*, struct g2v_encoder*);
+
+    /**
+     * @brief End function, depends on the encoder type. Called by the pipeline after the last frame was written.
+     * 
+     */
+    int(*end_fn)(g2v_render_ctx*, struct g2v_encoder*);
+
+    /**
+     * @brief User callback to render video frames.
+     * 
+     */
+    int(*render_video_frame)(g2v_render_ctx*, void*);
+
+    /**
+     * @brief User callback to render audio frames.
+     * 
+     */
+    int(*render_audio_frame)(g2v_render_ctx*, void*);
+
+    /**
+     * @brief User pointer.
+     * 
+     */
+    void* user_ptr;
+};
+
+/**
+ * @brief Abstract interface of a gl2vid video encoder
+ * 
+ */
+typedef struct g2v_encoder g2v_encoder;
+
+/**
+ * @brief Encode the whole media, using the encoder and render context specified
+ * 
+ * @param encoder pointer to initialized gl2vid video encoder
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_encode(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+
+/*
+    Incremental API, for applications which already have their own frame loop. Instead of calling g2v_encode(),
+    render each frame between g2v_begin_frame() and g2v_submit_frame(), and call g2v_poll() whenever there is time
+    to spare, then g2v_end_frames() after the last frame:
+
+        while(running) {
+            g2v_begin_frame(&encoder, &rctx);
+            render(...);
+            g2v_submit_frame(&encoder, &rctx);
+            g2v_poll(&encoder, &rctx);
+            ...application work...
+        }
+        g2v_end_frames(&encoder, &rctx);
+
+    Frames are handed to the encoder in order once their asynchronous readback has completed, so the pixels in
+    pix_data (and pix_data_frame_index) lag behind current_frame_index by up to targets frames.
+    render_video_frame is not used by this API.
+*/
+
+/**
+ * @brief Bind the render target of the next frame (with index current_frame_index) and set the viewport
+ * 
+ * This only blocks if the readbacks of all targets are still in flight, in which case the oldest frame is written first.
+ * 
+ * @param encoder pointer to initialized gl2vid video encoder
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_begin_frame(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Queue the asynchronous readback of the frame rendered since g2v_begin_frame(), without waiting for the GPU
+ * 
+ * @param encoder pointer to initialized gl2vid video encoder
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_submit_frame(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Mark the frame being rendered (between g2v_begin_frame() and g2v_submit_frame(), or in render_video_frame) as identical to the previous one
+ * 
+ * The frame is then neither read back nor converted, and reaches the encoder as a duplicate (see pix_data_duplicate),
+ * which leaves it out of the video with g2v_ffmpeg_options.drop_duplicates. Nothing has to be rendered for it.
+ * Ignored for the first frame.
+ * 
+ * @param render_ctx pointer to initialized gl2vid render context
+ */
+void g2v_mark_frame_unchanged(g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Report a rectangle of the frame being rendered which may differ from the previous frame
+ * 
+ * Only used if the render context was initialized with track_damage. If any damage is reported for a frame,
+ * everything outside of the reported rectangles must be identical to the previous frame. Frames without reported damage
+ * (or with more than G2V_MAX_DAMAGE_RECTS rectangles) are read back in full, and so is the first frame.
+ * 
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @param x left edge, in pixels
+ * @param y bottom edge, in pixels (framebuffer coordinates, like glViewport())
+ * @param width width, in pixels
+ * @param height height, in pixels
+ */
+void g2v_add_damage(g2v_render_ctx* render_ctx, int x, int y, int width, int height);
+
+/**
+ * @brief Queue the readback of the tile rendered since g2v_begin_frame() (or the previous call) and bind the next tile of the frame
+ * 
+ * In tiled mode, every tile of a frame must be rendered before g2v_submit_frame() (which submits the last one):
+ * 
+ *     g2v_begin_frame(&encoder, &rctx);
+ *     do {
+ *         render(...);     // offset by g2v_get_tile_matrix()
+ *     } while(g2v_next_tile(&encoder, &rctx) > 0);
+ *     g2v_submit_frame(&encoder, &rctx);
+ * 
+ * Without tiling, this does nothing and returns 0. g2v_encode() does this by itself, calling render_video_frame once per tile.
+ * 
+ * @param encoder pointer to initialized gl2vid video encoder
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return 1 if another tile must be rendered, 0 if the current tile is the last one of the frame, -1 if failed
+ */
+int g2v_next_tile(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Get the matrix which maps clip coordinates of the whole frame to clip coordinates of the current tile
+ * 
+ * Multiply it to the left of the projection matrix. It's the identity matrix without tiling.
+ * 
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @param matrix 4x4 matrix, column-major (as expected by glUniformMatrix4fv() without transposing)
+ */
+void g2v_get_tile_matrix(const g2v_render_ctx* render_ctx, float matrix[16]);
+
+/**
+ * @brief Accumulate the sub-frame rendered since g2v_begin_frame() (or the previous call) and bind the target of the next one
+ * 
+ * With accumulation, every sub-frame of a frame must be rendered before g2v_submit_frame() (which accumulates the last one):
+ * 
+ *     g2v_begin_frame(&encoder, &rctx);
+ *     do {
+ *         render((frame + g2v_get_subframe_offset(&rctx)) / fps);
+ *     } while(g2v_next_subframe(&rctx));
+ *     g2v_submit_frame(&encoder, &rctx);
+ * 
+ * Without accumulation, this does nothing and returns 0. g2v_encode() does this by itself, calling render_video_frame once per sub-frame.
+ * 
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return 1 if another sub-frame must be rendered, 0 if the current sub-frame is the last one of the frame
+ */
+int g2v_next_subframe(g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Get the time of the sub-frame being rendered, in frames since the start of the current frame
+ * 
+ * Sub-frames are spread evenly over the frame interval: accumulate_index / accumulate, so always 0 without accumulation.
+ * 
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return offset in [0, 1)
+ */
+double g2v_get_subframe_offset(const g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Write every submitted frame whose readback has already completed to the encoder, without waiting for the GPU
+ * 
+ * Completion can only be detected with GL_ARB_sync, without it frames are written by g2v_begin_frame() once all targets are in flight.
+ * 
+ * @param encoder pointer to initialized gl2vid video encoder
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return the number of frames written, or -1 if failed
+ */
+int g2v_poll(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Wait for all submitted frames, write them to the encoder and end the video stream
+ * 
+ * @param encoder pointer to initialized gl2vid video encoder
+ * @param render_ctx pointer to initialized gl2vid render context
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_end_frames(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+
+/**
+ * @brief Create a dummy video encoder, which doesn't actually encode, but show the internal gl2vid window (for OpenGL context) and update it (using glfwPollEvents() and glfwSwapBuffers()) every frame rendered
+ * This function is used to help debugging OpenGL on gl2vid without changing the source code too much.
+ * 
+ * Note: One GLFW encoder may be used at any time
+ * 
+ * @param enc pointer to allocated gl2vid video encoder
+ * @param ctx pointer to initialized gl2vid render context
+ * @return int G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_create_glfw_encoder(g2v_encoder* enc, g2v_render_ctx* ctx);
+
+/**
+ * @brief Restore the default behaviour of gl2vid after calling g2v_create_glfw_encoder()
+ * 
+ * @param enc pointer to initialized dummy GLFW video encoder
+ * @return G2V_TRUE if success, G2V_FALSE otherwise 
+ */
+int g2v_finish_glfw_encoder(g2v_encoder* enc);
+
+/**
+ * @brief Live preview of the frames in the gl2vid window, while an encoder writes them (see g2v_ffmpeg_options.preview)
+ * 
+ * Frames are blitted from their render target to the window on the GPU, and presented with a swap interval of 0,
+ * so the preview never waits for vsync nor slows down the encoding.
  * 
  */
 typedef struct {
     /**
-     * @brief Video frame dimensions
+     * @brief Show only every Nth frame, 0 or 1 for every frame
+     * 
+     */
+    int every_frames;
+
+    /**
+     * @brief Maximum refresh rate of the preview, in frames per second, 0 for no limit
+     * 
+     */
+    double max_fps;
+} g2v_preview_options;
+
+/**
+ * @brief Create a video encoder which writes raw frames (BGRA, rows from top to bottom, like pix_data) to a file or pipe
+ * 
+ * @param enc pointer to allocated gl2vid video encoder
+ * @param ctx pointer to initialized gl2vid render context
+ * @param output opened for binary writing (e.g. stdout, or popen() of another program), not closed by gl2vid
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_create_raw_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, FILE* output);
+
+/**
+ * @brief Free a raw video encoder
+ * 
+ * @param enc pointer to initialized raw video encoder
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_finish_raw_encoder(g2v_encoder* enc);
+
+/**
+ * @brief Create a video encoder which writes a line "<frame index> <g2v_hash_frame() of its pixels, in hex>" per frame, for QC
+ * 
+ * @param enc pointer to allocated gl2vid video encoder
+ * @param ctx pointer to initialized gl2vid render context
+ * @param output opened for writing, not closed by gl2vid
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_create_hash_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, FILE* output);
+
+/**
+ * @brief Free a hash video encoder
+ * 
+ * @param enc pointer to initialized hash video encoder
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_finish_hash_encoder(g2v_encoder* enc);
+
+/**
+ * @brief Options of a thumbnail encoder, used by g2v_create_thumbnail_encoder()
+ * 
+ * Always initialize this with g2v_thumbnail_default_options() before changing any field,
+ * so that fields added in the future get sensible values.
+ * 
+ */
+typedef struct {
+    /**
+     * @brief A thumbnail is taken every interval_frames frames, 5 seconds by default
+     * 
+     */
+    int interval_frames;
+
+    /**
+     * @brief Thumbnail dimensions, 160 pixels wide by default. A height of 0 keeps the aspect ratio of the video
      * 
      */
     int width, height;
 
     /**
-     * @brief Current frame index, starts from 0
+     * @brief Number of thumbnails per row and per column of a sprite sheet, 10 x 10 by default
      * 
      */
-    int current_frame_index;
+    int columns, rows;
 
     /**
-     * @brief Framebuffers for all rendering works to be rendered on
+     * @brief Number of frames per second of the video, for the times of the WebVTT index
      * 
      */
-    GLuint framebuffers[G2V_TARGETS];
-#ifdef G2V_TARGET_RENDERBUFFER
+    int fps;
+
     /**
-     * @brief Renderbuffer attachment for framebuffers
+     * @brief Filename pattern of the sprite sheets, with one %d for the sheet index (e.g. "thumbs%03d.bmp")
+     * 
+     * The pattern must hold exactly one %d (optionally zero padded, e.g. %03d), any other percent sign written as %%.
+     * Sheets are written as 32 bit BMP images, which browsers display directly.
      * 
      */
-    GLuint renderbuffers[G2V_TARGETS];
-#else
+    const char* sheet_file;
+
     /**
-     * @brief Texture attachment for framebuffers
+     * @brief WebVTT index of the thumbnails (e.g. for video player scrubbing previews), NULL for none
      * 
      */
-    GLuint textures[G2V_TARGETS];
-#endif
+    const char* vtt_file;
+} g2v_thumbnail_options;
+
+/**
+ * @brief Fill an options struct with the default thumbnail encoder options
+ * 
+ * @param opts pointer to the options to be initialized
+ * @param fps number of frames per second of the video
+ * @param sheet_file filename pattern of the sprite sheets, see g2v_thumbnail_options.sheet_file
+ * @param vtt_file WebVTT index filename, NULL for none
+ */
+void g2v_thumbnail_default_options(g2v_thumbnail_options* opts, int fps, const char* sheet_file, const char* vtt_file);
+
+/**
+ * @brief Create an encoder which makes thumbnail sprite sheets of the frames, usually a sink of a tee encoder next to a file encoder
+ * 
+ * Every interval_frames frames, the frame is downscaled on the GPU (box filter) into a thumbnail sized target, and only that
+ * thumbnail is read back, asynchronously. The sheets are written as they fill up, and the last one along with the WebVTT index
+ * by g2v_finish_thumbnail_encoder(), which must be called on the rendering thread. The render context can't use tiling.
+ * 
+ * @param enc pointer to allocated gl2vid video encoder
+ * @param ctx pointer to initialized gl2vid render context
+ * @param opts pointer to thumbnail options, initialized with g2v_thumbnail_default_options()
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_create_thumbnail_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_thumbnail_options* opts);
+
+/**
+ * @brief Write the remaining thumbnails and the WebVTT index, and free a thumbnail encoder
+ * 
+ * @param enc pointer to initialized thumbnail encoder
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_finish_thumbnail_encoder(g2v_encoder* enc);
+
+/**
+ * @brief Maximum number of sinks of a tee encoder
+ * 
+ */
+#define G2V_MAX_SINKS 8
+
+/**
+ * @brief One output of a tee encoder, see g2v_create_tee_encoder()
+ * 
+ */
+typedef struct {
+    /**
+     * @brief Initialized encoder which writes frames (ffmpeg, raw, hash, ...), created with the same render context
+     * 
+     */
+    g2v_encoder* encoder;
 
     /**
-     * @brief Pixel buffer objects for speeding up CPU-GPU pixels transfer
+     * @brief Maximum number of frames waiting for this sink, 0 for 2
      * 
      */
-    GLuint pbos[G2V_TARGETS];
+    int queue_frames;
 
     /**
-     * @brief Current pixel data, in RGBA32 (for better alignment, and maybe transparency support in the future)
+     * @brief What happens when the queue is full: G2V_FALSE waits for the sink (and so slows down the render), G2V_TRUE skips the frame for this sink
      * 
+     * Skipped frames leave gaps in the frame indices the sink sees, so this is meant for previews and monitoring, not for archives.
      * 
      */
-    int* pix_data;
-} g2v_render_ctx;
+    int drop_when_full;
+} g2v_tee_sink;
 
 /**
- * @brief Initialize a allocated gl2vid render context
+ * @brief Create a video encoder which hands every read back frame to several encoders (sinks)
  * 
- * @param ctx pointer to the allocated render context
- * @param width width of new video frame
- * @param height height of new video frame
+ * Every sink has its own thread and queue. Frames are shared by reference between the sinks: pix_data alternates between
+ * a pool of buffers, each one recycled once every sink is done with it, so frames are read back and flipped only once.
+ * Encoders with neither a write nor a submit function (like the GLFW encoder) can't be sinks, the tee previews frames itself instead
+ * (previews of the sinks themselves work too, they are shown from the render thread). Sinks with only a submit function
+ * (like the thumbnail encoder) are called from the render thread, and never queue frames.
+ * The render context can't use tiling or track_damage. The sinks must be finished by their own functions after the tee encoder.
+ * 
+ * @param enc pointer to allocated gl2vid video encoder
+ * @param ctx pointer to initialized gl2vid render context
+ * @param sinks the sinks, up to G2V_MAX_SINKS
+ * @param count number of sinks
+ * @param preview options of the live preview, NULL for none
  * @return G2V_TRUE if success, G2V_FALSE otherwise
  */
-int g2v_init_render_ctx(g2v_render_ctx* ctx, int width, int height);
+int g2v_create_tee_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_tee_sink* sinks, int count, const g2v_preview_options* preview);
 
 /**
- * @brief Deinit the allocated gl2vid render context
+ * @brief Free a tee encoder, after stopping its threads
  * 
- * @param ctx pointer to the render context to be deinited
+ * @param enc pointer to initialized tee video encoder
+ * @return G2V_TRUE if success (every sink wrote every frame it was handed), G2V_FALSE otherwise
  */
-void g2v_free_render_ctx(g2v_render_ctx* ctx);
+int g2v_finish_tee_encoder(g2v_encoder* enc);
+
+#ifdef G2V_USE_FFMPEG_ENCODER
 
 /**
- * @brief Abstract interface of a gl2vid video encoder
+ * @brief Create a video encoder which internally uses ffmpeg, with frame dimensions fetched from the render context.
  * 
+ * @param enc pointer to allocated gl2vid video encoder
+ * @param ctx pointer to initialized gl2vid render context
+ * @param fps number of frames per second of output video
+ * @param output_file output filename
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
  */
-struct g2v_encoder {
+int g2v_create_ffmpeg_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, int fps, const char* output_file);
+
+/**
+ * @brief Options of an ffmpeg video encoder, used by g2v_create_ffmpeg_encoder_ex()
+ * 
+ * Always initialize this with g2v_ffmpeg_default_options() before changing any field,
+ * so that fields added in the future get sensible values.
+ * 
+ */
+typedef struct {
     /**
-     * @brief Internal data, depends on the encoder type
+     * @brief Number of frames per second of output video
      * 
      */
-    void* internal_data;
+    int fps;
 
     /**
-     * @brief Encode function, depends on the encoder type
+     * @brief Output filename, the container is guessed from its extension
      * 
      */
-    int(*encode_fn)(g2v_render_ctx*, struct g2v_encoder*);
+    const char* output_file;
 
     /**
-     * @brief User callback to render video frames.
+     * @brief Number of frames per segment in resumable mode, 0 (the default) writes one monolithic file
+     * 
+     * In resumable mode, every segment is encoded as an independent closed-GOP file next to output_file
+     * (output.mkv -> output.seg00000.mkv, output.seg00001.mkv, ...) and recorded in the journal once
+     * it is completely written. If the encoder is created again with the same journal (e.g. after a crash),
+     * the completed segments are kept and the render context skips straight to the first unfinished one
+     * by setting current_frame_index, so the render callback must derive its content from the frame index.
+     * Once the render has completed, g2v_finish_ffmpeg_encoder() concatenates all segments into output_file, then removes
+     * the segments and the journal. After a failed render it only removes the unfinished segment, and keeps the rest for resuming.
      * 
      */
-    int(*render_video_frame)(g2v_render_ctx*, void*);
+    int segment_frames;
 
     /**
-     * @brief User callback to render audio frames.
+     * @brief Journal filename for resumable mode, NULL (the default) means "<output_file>.journal"
      * 
      */
-    int(*render_audio_frame)(g2v_render_ctx*, void*);
+    const char* journal_file;
 
     /**
-     * @brief User pointer.
+     * @brief Name of the encoder (e.g. "libx264"), NULL (the default) uses the default encoder of the container
      * 
      */
-    void* user_ptr;
-};
+    const char* codec_name;
+
+    /**
+     * @brief Encoder preset (e.g. "veryfast" for libx264), NULL (the default) keeps the encoder default
+     * 
+     */
+    const char* preset;
+
+    /**
+     * @brief Further encoder options as "key=value:key=value", generic or private to the encoder (e.g. "slices=24:threads=auto"), NULL by default
+     * 
+     */
+    const char* codec_options;
+
+    /**
+     * @brief libswscale flags used for the RGB to YUV conversion (e.g. SWS_POINT), 0 (the default) keeps the libswscale default
+     * 
+     */
+    int sws_flags;
+
+    /**
+     * @brief Variable frame rate mode: leave duplicate frames out of the video, G2V_FALSE by default
+     * 
+     * Duplicates are frames marked with g2v_mark_frame_unchanged() or detected by g2v_render_options.detect_duplicates.
+     * Every frame keeps the timestamp of its frame index (in a 1/fps time base), so the previous frame is shown until
+     * the next different one and the timeline stays the same as in constant frame rate.
+     * Containers without timestamps (e.g. raw streams) can't do this, so duplicates are always encoded in them,
+     * although without converting them again.
+     * 
+     */
+    int drop_duplicates;
+
+    /**
+     * @brief Encode in the pixel format of pix_data if the codec accepts it, G2V_FALSE by default (frames are converted to YUV420P)
+     * 
+     * The pixel format is negotiated with the codec: if it takes BGRA (or BGR0, like libx264rgb), or GBRP with a
+     * G2V_PIXELS_GBRP render context (e.g. utvideo, FFV1), frames are only copied into the encoder frame, without
+     * any conversion. Otherwise they are converted to the closest format the codec accepts (e.g. ARGB for qtrle).
+     * 
+     */
+    int rgb_direct;
+
+    /**
+     * @brief Live preview of the frames being encoded, NULL (the default) for none
+     * 
+     * With a ladder encoder, only the preview of the first rendition is used. Can't be combined with tiling.
+     * 
+     */
+    const g2v_preview_options* preview;
+} g2v_ffmpeg_options;
 
 /**
- * @brief Abstract interface of a gl2vid video encoder
+ * @brief Fill an options struct with the default ffmpeg encoder options
  * 
+ * @param opts pointer to the options to be initialized
+ * @param fps number of frames per second of output video
+ * @param output_file output filename
  */
-typedef struct g2v_encoder g2v_encoder;
+void g2v_ffmpeg_default_options(g2v_ffmpeg_options* opts, int fps, const char* output_file);
 
 /**
- * @brief Encode the whole media, using the encoder and render context specified
+ * @brief Lossless intra-only codecs for intermediate captures, see g2v_ffmpeg_intermediate_options()
  * 
- * @param encoder pointer to initialized gl2vid video encoder
- * @param render_ctx pointer to initialized gl2vid render context
- * @return G2V_TRUE if success, G2V_FALSE otherwise
  */
-int g2v_encode(g2v_encoder* encoder, g2v_render_ctx* render_ctx);
+typedef enum {
+    G2V_INTERMEDIATE_FFV1,    /**< FFV1 version 3, 24 slices with CRCs, every frame a keyframe (e.g. in .mkv) */
+    G2V_INTERMEDIATE_UTVIDEO, /**< Ut Video with left prediction and 24 slices, faster than FFV1 but larger (e.g. in .mkv or .avi) */
+} g2v_intermediate_codec;
 
 /**
- * @brief Create a dummy video encoder, which doesn't actually encode, but show the internal gl2vid window (for OpenGL context) and update it (using glfwPollEvents() and glfwSwapBuffers()) every frame rendered
- * This function is used to help debugging OpenGL on gl2vid without changing the source code too much.
+ * @brief Fill an options struct for a fast lossless intermediate capture, to be transcoded later with g2v_transcode()
  * 
- * Note: One GLFW encoder may be used at any time
+ * Frames are split in slices which are compressed on all cores, and rgb_direct is set so that they aren't converted
+ * (FFV1 takes BGRA, Ut Video takes planar RGB, i.e. a render context with G2V_PIXELS_GBRP). This lets a capture run at
+ * render speed, and the delivery encode happen later on other machines.
+ * 
+ * @param opts pointer to the options to be initialized
+ * @param fps number of frames per second of output video
+ * @param output_file output filename
+ * @param codec lossless codec of the intermediate
+ */
+void g2v_ffmpeg_intermediate_options(g2v_ffmpeg_options* opts, int fps, const char* output_file, g2v_intermediate_codec codec);
+
+/**
+ * @brief Create a video encoder which internally uses ffmpeg, with frame dimensions fetched from the render context.
+ * 
+ * In resumable mode, this may change the current_frame_index of the render context to resume an interrupted render.
  * 
  * @param enc pointer to allocated gl2vid video encoder
  * @param ctx pointer to initialized gl2vid render context
- * @return int G2V_TRUE if success, G2V_FALSE otherwise
+ * @param opts pointer to encoder options, initialized with g2v_ffmpeg_default_options()
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
  */
-int g2v_create_glfw_encoder(g2v_encoder* enc, g2v_render_ctx* ctx);
+int g2v_create_ffmpeg_encoder_ex(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_ffmpeg_options* opts);
 
 /**
- * @brief Restore the default behaviour of gl2vid after calling g2v_create_glfw_encoder()
+ * @brief Maximum number of renditions of an ffmpeg ladder encoder
  * 
- * @param enc pointer to initialized dummy GLFW video encoder
- * @return G2V_TRUE if success, G2V_FALSE otherwise 
  */
-int g2v_finish_glfw_encoder(g2v_encoder* enc);
+#define G2V_MAX_RENDITIONS 8
 
-#ifdef G2V_USE_FFMPEG_ENCODER
+/**
+ * @brief One output of an ffmpeg ladder encoder, see g2v_create_ffmpeg_ladder_encoder()
+ * 
+ */
+typedef struct {
+    /**
+     * @brief Video frame dimensions, 0 for the dimensions of the render context
+     * 
+     */
+    int width, height;
+
+    /**
+     * @brief Options of the encoder of this rendition, initialized with g2v_ffmpeg_default_options()
+     * 
+     * The fps must be the same for all renditions, and resumable mode (segment_frames) isn't supported.
+     * 
+     */
+    g2v_ffmpeg_options ffmpeg;
+} g2v_rendition;
 
 /**
- * @brief Create a video encoder which internally uses ffmpeg, with frame dimensions fetched from the render context.
+ * @brief Create a video encoder which writes several renditions (e.g. an adaptive bitrate ladder) of a single render
+ * 
+ * Frames are rendered once at the resolution of the render context, which is the first rendition. The other (smaller)
+ * renditions are downscaled from each frame on the GPU with a box filter, into their own targets and readback ring.
+ * Every rendition has its own ffmpeg encoder, fed by its own thread, so all renditions are converted and encoded in parallel.
+ * Frames marked with g2v_mark_frame_unchanged() are duplicates in every rendition.
+ * The render context can't use tiling or track_damage.
  * 
  * @param enc pointer to allocated gl2vid video encoder
  * @param ctx pointer to initialized gl2vid render context
- * @param fps number of frames per second of output video
- * @param output_file output filename
+ * @param renditions renditions[0] is the resolution of the render context, the others must not be larger
+ * @param count number of renditions, up to G2V_MAX_RENDITIONS
  * @return G2V_TRUE if success, G2V_FALSE otherwise
  */
-int g2v_create_ffmpeg_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, int fps, const char* output_file);
+int g2v_create_ffmpeg_ladder_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, const g2v_rendition* renditions, int count);
+
+/**
+ * @brief Finish encoding of an ffmpeg ladder encoder (finish every rendition + free allocated memory)
+ * 
+ * @param enc pointer to initialized ffmpeg ladder encoder
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_finish_ffmpeg_ladder_encoder(g2v_encoder* enc);
 
 /**
  * @brief Create an audio stream for an ffmpeg video encoder
@@ -218,9 +1293,26 @@ int g2v_create_ffmpeg_encoder(g2v_encoder* enc, g2v_render_ctx* ctx, int fps, co
  */
 int g2v_init_ffmpeg_audio_stream(g2v_encoder* enc);
 
+/**
+ * @brief Encode the video of an existing file (e.g. an intermediate capture) again, without any OpenGL context
+ * 
+ * The video stream of input_file is decoded on all cores, converted if needed (see rgb_direct) and encoded to
+ * opts->output_file with the codec and options of opts. Frames keep their timestamps, rescaled to 1/opts->fps, so
+ * captures made with drop_duplicates keep their timeline. If the input has a higher frame rate, frames falling on a
+ * timestamp already written are dropped. segment_frames, drop_duplicates and preview are ignored.
+ * 
+ * @param input_file file to read the video from
+ * @param opts pointer to encoder options, initialized with g2v_ffmpeg_default_options()
+ * @return G2V_TRUE if success, G2V_FALSE otherwise
+ */
+int g2v_transcode(const char* input_file, const g2v_ffmpeg_options* opts);
+
 /**
  * @brief Finish encoding of an ffmpeg encoder (write trailer + free allocated memory)
  * 
+ * In resumable mode, this also concatenates all segments into the output file, if the render completed
+ * (otherwise the completed segments and the journal are kept, and G2V_FALSE is returned).
+ * 
  * @param enc pointer to initialized ffmpeg video encoder
  * @return G2V_TRUE if success, G2V_FALSE otherwise 
  */
@@ -265,6 +1357,79 @@ int g2v_finish_nv_encoder(g2v_encoder* enc);
 
 #endif
 
+/**
+ * @brief Get the number of heap allocations made by gl2vid since the program started
+ * 
+ * This counts the allocations of gl2vid itself, the packet buffers it provides to the encoder (which come from a pool
+ * that only allocates when it runs dry) and the video frame buffers reallocated because the encoder still holds them.
+ * Once warmed up, encoding a frame doesn't allocate, i.e. this stays constant. Small bookkeeping allocations inside
+ * libavcodec/libavformat and allocations of the OpenGL driver are not counted.
+ * 
+ * @return the number of allocations
+ */
+unsigned long long g2v_get_alloc_count();
+
+/**
+ * @brief Alignment in bytes of the large buffers (frames, queues, packet pools) allocated by gl2vid
+ * 
+ */
+#define G2V_BUFFER_ALIGNMENT 64
+
+/**
+ * @brief Allocator of the large buffers of gl2vid: frame buffers, queues and the encoder packet pool
+ * 
+ * alloc must return memory aligned to G2V_BUFFER_ALIGNMENT (or NULL if failed), free receives the size passed to alloc.
+ * Both may be called from any thread.
+ */
+typedef struct g2v_allocator {
+    void* (*alloc)(size_t size, void* userptr);
+    void (*free)(void* ptr, size_t size, void* userptr);
+    void* userptr;
+} g2v_allocator;
+
+/**
+ * @brief Get the built-in allocator
+ * 
+ * It returns G2V_BUFFER_ALIGNMENT aligned memory, and backs buffers of 2MB or more with huge pages where available:
+ * explicit huge pages (MAP_HUGETLB) or else transparent huge pages (MADV_HUGEPAGE) on Linux, and large pages on Windows
+ * (which need the SeLockMemoryPrivilege). Otherwise it falls back to the heap.
+ * 
+ * @param allocator pointer to the allocator to fill
+ */
+void g2v_get_default_allocator(g2v_allocator* allocator);
+
+/**
+ * @brief Replace the allocator of the large buffers
+ * 
+ * Must be called before any render context or encoder is created, since buffers are freed with the allocator which is current at that time.
+ * 
+ * @param allocator pointer to the allocator to copy, or NULL to restore the built-in one
+ */
+void g2v_set_allocator(const g2v_allocator* allocator);
+
+/**
+ * @brief CPU kernel which copies an image while reversing the order of its rows, used to turn glReadPixels output upside up
+ * 
+ * Exposed for benchmarking, the kernel works on any horizontal band of an image as well.
+ * 
+ * @param dst destination pixels, width * height
+ * @param src source pixels, width * height, must not overlap dst
+ * @param width image width, in pixels
+ * @param height image height, in pixels
+ */
+void g2v_flip_rows(int* dst, const int* src, int width, int height);
+
+/**
+ * @brief CPU kernel which computes the 64-bit hash used for duplicate frame detection
+ * 
+ * Exposed for benchmarking. It uses the vectorizable accumulate loop of XXH3, but its results differ from XXH3.
+ * 
+ * @param data bytes to hash
+ * @param size number of bytes
+ * @return the hash, never 0
+ */
+unsigned long long g2v_hash_frame(const void* data, size_t size);
+
 /**
  * @brief Basically glfwGetTime(), included to measure encoding time. If you are using C++, std::chrono::high_resolution_clock should be preferred.
  * 
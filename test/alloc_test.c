@@ -0,0 +1,50 @@
+#include "gl2vid.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+
+/*
+    alloc_test: checks that encoding a frame doesn't allocate once the pipeline is warmed up,
+    i.e. that g2v_get_alloc_count() stays constant while frames are encoded.
+*/
+
+#define CHECK(x) if(!(x)) { fprintf(stderr, "Error occurred: %s\n", g2v_get_error_log()); exit(1); }
+#define FPS 25
+#define WARMUP_FRAMES 50
+#define MEASURED_FRAMES 200
+
+void render_frames(g2v_encoder* encoder, g2v_render_ctx* rctx, int frames) {
+    for(int i = 0; i < frames; i++) {
+        CHECK(g2v_begin_frame(encoder, rctx))
+        float c = (float)(rctx->current_frame_index % FPS) / FPS;
+        glClearColor(c, 1.0f - c, c, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        CHECK(g2v_submit_frame(encoder, rctx))
+        CHECK(g2v_poll(encoder, rctx) >= 0)
+    }
+}
+
+int main() {
+    CHECK(g2v_create_context())
+
+    g2v_render_ctx rctx;
+    g2v_encoder encoder;
+
+    CHECK(g2v_init_render_ctx(&rctx, 320, 240))
+    CHECK(g2v_create_ffmpeg_encoder(&encoder, &rctx, FPS, "alloc_test.mkv"))
+
+    //Fills the packet pool and lets the encoder reach its steady state (lookahead, reference frames)
+    render_frames(&encoder, &rctx, WARMUP_FRAMES);
+
+    unsigned long long before = g2v_get_alloc_count();
+    render_frames(&encoder, &rctx, MEASURED_FRAMES);
+    unsigned long long allocations = g2v_get_alloc_count() - before;
+
+    CHECK(g2v_end_frames(&encoder, &rctx))
+    CHECK(g2v_finish_ffmpeg_encoder(&encoder))
+    g2v_free_render_ctx(&rctx);
+    g2v_free_context();
+
+    printf("%llu allocations in %d frames (%.3f per frame)\n", allocations, MEASURED_FRAMES, (double)allocations / MEASURED_FRAMES);
+    return allocations == 0 ? 0 : 1;
+}
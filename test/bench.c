@@ -0,0 +1,571 @@
+#include "gl2vid.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "libswscale/swscale.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/*
+    g2v_bench: sweeps resolution, scene cost, readback depth, conversion path and encoder preset,
+    and reports throughput, per-stage timings, CPU utilisation and peak RSS of every combination.
+
+    On GPU-less machines, run it with --software (Mesa llvmpipe) under a virtual X server, e.g.
+        xvfb-run ./g2v_bench --software --format json --output results.json
+
+    Regression mode: a JSON report produced on the reference machine is the baseline, later runs with
+        ./g2v_bench <same sweep options> --baseline baseline.json --threshold 5
+    print a comparison table and exit with status 2 if the throughput or the p99 frame time of any
+    combination got worse by more than the threshold (in percent).
+*/
+
+#define CHECK(x) if(!(x)) { fprintf(stderr, "Error occurred: %s\n", g2v_get_error_log()); exit(1); }
+#define MAX_VALUES 16
+#define MAX_CASES 1024
+
+typedef struct {
+    const char* name;
+    int width, height;
+} resolution;
+
+const resolution resolutions[] = {
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "1440p", 2560, 1440 },
+    { "4k", 3840, 2160 },
+    { "8k", 7680, 4320 },
+};
+
+typedef struct {
+    const char* name;
+    int flags;
+} conversion;
+
+const conversion conversions[] = {
+    { "default", 0 },
+    { "point", SWS_POINT },
+    { "fast_bilinear", SWS_FAST_BILINEAR },
+    { "bilinear", SWS_BILINEAR },
+    { "bicubic", SWS_BICUBIC },
+};
+
+typedef struct {
+    const char* values[MAX_VALUES];
+    int count;
+} value_list;
+
+typedef struct {
+    value_list resolutions, scenes, depths, conversions, presets;
+    const char* codec;
+    const char* output_file;
+    const char* report_file;
+    const char* baseline_file;
+    double threshold;
+    int json;
+    int frames;
+    int fps;
+} bench_config;
+
+typedef struct {
+    const resolution* res;
+    const char* scene;
+    int depth;
+    const conversion* conv;
+    const char* preset;
+} bench_case;
+
+typedef struct {
+    int frames;
+    double seconds, fps;
+    double frame_p99_ms;
+    double cpu_util;
+    long peak_rss_kb;
+    g2v_stats stats;
+} bench_result;
+
+/*
+    Scenes
+*/
+
+typedef struct {
+    const char* scene;
+    int frames;
+    //Wall-clock time at every render callback, for frame time percentiles
+    double* frame_times;
+    GLuint program, vao, vbo;
+    GLint offset_loc, scale_loc, color_loc;
+} scene_state;
+
+const char* vertex_src =
+    "#version 130\n"
+    "in vec2 pos;\n"
+    "uniform vec2 offset;\n"
+    "uniform vec2 scale;\n"
+    "out vec2 uv;\n"
+    "void main() { uv = pos * 0.5 + 0.5; gl_Position = vec4(pos * scale + offset, 0.0, 1.0); }\n";
+
+//Deliberately expensive per fragment, to make the fill-rate scene GPU-bound
+const char* fragment_src =
+    "#version 130\n"
+    "in vec2 uv;\n"
+    "uniform vec4 color;\n"
+    "out vec4 frag;\n"
+    "void main() {\n"
+    "    float v = 0.0;\n"
+    "    for(int i = 1; i <= 16; i++) v += sin(uv.x * float(i) * 13.0) * cos(uv.y * float(i) * 7.0);\n"
+    "    frag = vec4(color.rgb * (0.75 + 0.25 * v / 16.0), color.a);\n"
+    "}\n";
+
+GLuint compile_shader(GLenum type, const char* src) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &src, NULL);
+    glCompileShader(shader);
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if(!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof log, NULL, log);
+        fprintf(stderr, "Shader compilation failed: %s\n", log);
+        exit(1);
+    }
+    return shader;
+}
+
+void init_scene(scene_state* s) {
+    const float quad[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+    GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_src);
+    GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_src);
+    s->program = glCreateProgram();
+    glAttachShader(s->program, vs);
+    glAttachShader(s->program, fs);
+    glBindAttribLocation(s->program, 0, "pos");
+    glBindFragDataLocation(s->program, 0, "frag");
+    glLinkProgram(s->program);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    s->offset_loc = glGetUniformLocation(s->program, "offset");
+    s->scale_loc = glGetUniformLocation(s->program, "scale");
+    s->color_loc = glGetUniformLocation(s->program, "color");
+
+    glGenVertexArrays(1, &s->vao);
+    glGenBuffers(1, &s->vbo);
+    glBindVertexArray(s->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, s->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof quad, quad, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+}
+
+void free_scene(scene_state* s) {
+    glDeleteProgram(s->program);
+    glDeleteVertexArrays(1, &s->vao);
+    glDeleteBuffers(1, &s->vbo);
+}
+
+int render_video_frame(g2v_render_ctx* ctx, void* userptr) {
+    scene_state* s = userptr;
+    int i = ctx->current_frame_index;
+    float t = (float)i / s->frames;
+    s->frame_times[i <= s->frames ? i : s->frames] = g2v_get_time();
+
+    glClearColor(t, 0.5f * t, 1.0f - t, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if(strcmp(s->scene, "fill") == 0) {
+        //16 blended full-screen layers of an expensive fragment shader
+        glUseProgram(s->program);
+        glBindVertexArray(s->vao);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glUniform2f(s->offset_loc, 0, 0);
+        glUniform2f(s->scale_loc, 1, 1);
+        for(int layer = 0; layer < 16; layer++) {
+            glUniform4f(s->color_loc, t, (float)layer / 16, 0.5f, 0.25f);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        }
+        glDisable(GL_BLEND);
+    } else if(strcmp(s->scene, "draws") == 0) {
+        //4096 tiny quads, one draw call each
+        glUseProgram(s->program);
+        glBindVertexArray(s->vao);
+        glUniform2f(s->scale_loc, 1.0f / 64, 1.0f / 64);
+        for(int q = 0; q < 4096; q++) {
+            float x = (q % 64) / 32.0f - 1 + 1.0f / 64, y = (q / 64) / 32.0f - 1 + 1.0f / 64;
+            glUniform2f(s->offset_loc, x, y);
+            glUniform4f(s->color_loc, (q % 64) / 64.0f, t, (q / 64) / 64.0f, 1);
+            glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        }
+    }
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    return i >= s->frames;
+}
+
+/*
+    Process statistics
+*/
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+//p99 of the time between consecutive render callbacks, i.e. of the whole pipeline per frame
+double frame_time_p99(const double* times, int frames) {
+    if(frames < 2) {
+        return 0;
+    }
+    double* intervals = malloc((frames - 1) * sizeof(double));
+    for(int i = 1; i < frames; i++) {
+        intervals[i - 1] = times[i] - times[i - 1];
+    }
+    qsort(intervals, frames - 1, sizeof(double), compare_doubles);
+    double p99 = intervals[(frames - 2) * 99 / 100];
+    free(intervals);
+    return p99;
+}
+
+void get_process_usage(double* cpu_seconds, long* peak_rss_kb) {
+#ifndef _WIN32
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    *peak_rss_kb = usage.ru_maxrss;
+#else
+    *cpu_seconds = -1;
+    *peak_rss_kb = -1;
+#endif
+}
+
+bench_result run_case(const bench_config* cfg, const bench_case* c) {
+    g2v_render_options ropts;
+    g2v_render_default_options(&ropts, c->res->width, c->res->height);
+    ropts.targets = c->depth;
+
+    g2v_ffmpeg_options fopts;
+    g2v_ffmpeg_default_options(&fopts, cfg->fps, cfg->output_file);
+    fopts.codec_name = cfg->codec;
+    fopts.preset = c->preset;
+    fopts.sws_flags = c->conv->flags;
+
+    g2v_render_ctx rctx;
+    g2v_encoder encoder;
+    scene_state scene = { c->scene, cfg->frames };
+    scene.frame_times = calloc(cfg->frames + 1, sizeof(double));
+    init_scene(&scene);
+
+    CHECK(g2v_init_render_ctx_ex(&rctx, &ropts))
+    CHECK(g2v_create_ffmpeg_encoder_ex(&encoder, &rctx, &fopts))
+    encoder.render_video_frame = render_video_frame;
+    encoder.user_ptr = &scene;
+
+    bench_result r;
+    double cpu_start, cpu_end;
+    long rss;
+    get_process_usage(&cpu_start, &rss);
+    double start = g2v_get_time();
+    CHECK(g2v_encode(&encoder, &rctx))
+    CHECK(g2v_finish_ffmpeg_encoder(&encoder))
+    r.seconds = g2v_get_time() - start;
+    get_process_usage(&cpu_end, &r.peak_rss_kb);
+
+    r.frames = cfg->frames;
+    r.fps = r.frames / r.seconds;
+    r.cpu_util = cpu_start < 0 ? -1 : (cpu_end - cpu_start) / r.seconds;
+    r.frame_p99_ms = frame_time_p99(scene.frame_times, r.frames) * 1e3;
+    g2v_get_stats(&rctx, &r.stats);
+
+    g2v_free_render_ctx(&rctx);
+    free_scene(&scene);
+    free(scene.frame_times);
+    return r;
+}
+
+/*
+    Reports
+*/
+
+void case_name(const bench_case* c, char* out, size_t size) {
+    snprintf(out, size, "%s/%s/d%d/%s/%s", c->res->name, c->scene, c->depth, c->conv->name, c->preset);
+}
+
+void print_csv_header(FILE* f) {
+    fprintf(f, "resolution,width,height,scene,depth,convert,preset,frames,seconds,fps,frame_p99_ms,cpu_util,peak_rss_kb");
+    for(int i = 0; i < G2V_STAGE_COUNT; i++) {
+        const char* name = g2v_stage_name(i);
+        fprintf(f, ",%s_p50_ms,%s_p95_ms,%s_p99_ms,%s_max_ms", name, name, name, name);
+    }
+    fprintf(f, "\n");
+}
+
+void print_csv_row(FILE* f, const bench_case* c, const bench_result* r) {
+    fprintf(f, "%s,%d,%d,%s,%d,%s,%s,%d,%.3f,%.2f,%.3f,%.2f,%ld", c->res->name, c->res->width, c->res->height,
+        c->scene, c->depth, c->conv->name, c->preset, r->frames, r->seconds, r->fps, r->frame_p99_ms, r->cpu_util, r->peak_rss_kb);
+    for(int i = 0; i < G2V_STAGE_COUNT; i++) {
+        const g2v_stage_stats* s = &r->stats.stages[i];
+        fprintf(f, ",%.3f,%.3f,%.3f,%.3f", s->p50 * 1e3, s->p95 * 1e3, s->p99 * 1e3, s->max * 1e3);
+    }
+    fprintf(f, "\n");
+}
+
+//One result object per line, which keeps the file diffable and trivial to parse back
+void print_json_row(FILE* f, const bench_case* c, const bench_result* r, int first) {
+    char name[128];
+    case_name(c, name, sizeof name);
+    fprintf(f, "%s{\"case\":\"%s\",\"resolution\":\"%s\",\"width\":%d,\"height\":%d,\"scene\":\"%s\",\"depth\":%d,\"convert\":\"%s\",\"preset\":\"%s\","
+        "\"frames\":%d,\"seconds\":%.3f,\"fps\":%.2f,\"frame_p99_ms\":%.3f,\"cpu_util\":%.2f,\"peak_rss_kb\":%ld,\"stages\":{",
+        first ? "" : ",\n", name,
+        c->res->name, c->res->width, c->res->height, c->scene, c->depth, c->conv->name, c->preset,
+        r->frames, r->seconds, r->fps, r->frame_p99_ms, r->cpu_util, r->peak_rss_kb);
+    for(int i = 0; i < G2V_STAGE_COUNT; i++) {
+        const g2v_stage_stats* s = &r->stats.stages[i];
+        fprintf(f, "%s\"%s\":{\"p50_ms\":%.3f,\"p95_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}", i ? "," : "",
+            g2v_stage_name(i), s->p50 * 1e3, s->p95 * 1e3, s->p99 * 1e3, s->max * 1e3);
+    }
+    fprintf(f, "}}");
+}
+
+/*
+    Regression check against a baseline report
+*/
+
+typedef struct {
+    char name[128];
+    double fps, frame_p99_ms;
+} baseline_entry;
+
+int json_number(const char* line, const char* key, double* value) {
+    const char* p = strstr(line, key);
+    return p && sscanf(p + strlen(key), "%lf", value) == 1;
+}
+
+//Reads back the one-object-per-line reports written by print_json_row()
+int load_baseline(const char* filename, baseline_entry* entries, int max) {
+    FILE* f = fopen(filename, "r");
+    if(!f) {
+        fprintf(stderr, "Could not open baseline %s\n", filename);
+        exit(1);
+    }
+    char line[4096];
+    int n = 0;
+    while(n < max && fgets(line, sizeof line, f)) {
+        const char* name = strstr(line, "\"case\":\"");
+        if(!name) {
+            continue;
+        }
+        name += strlen("\"case\":\"");
+        const char* end = strchr(name, '"');
+        if(!end) {
+            continue;
+        }
+        baseline_entry* e = &entries[n];
+        snprintf(e->name, sizeof e->name, "%.*s", (int)(end - name), name);
+        if(json_number(line, "\"fps\":", &e->fps) && json_number(line, "\"frame_p99_ms\":", &e->frame_p99_ms)) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+//Prints the comparison table, returns the number of regressions
+int compare_with_baseline(const bench_config* cfg, const bench_case* cases, const bench_result* results, int count) {
+    static baseline_entry baseline[MAX_CASES];
+    int baseline_count = load_baseline(cfg->baseline_file, baseline, MAX_CASES);
+    int regressions = 0;
+
+    fprintf(stderr, "\n%-40s %10s %10s %8s %12s %12s %8s  %s\n", "case", "base fps", "fps", "delta", "base p99 ms", "p99 ms", "delta", "status");
+    for(int i = 0; i < count; i++) {
+        char name[128];
+        case_name(&cases[i], name, sizeof name);
+        const baseline_entry* base = NULL;
+        for(int j = 0; j < baseline_count; j++) {
+            if(strcmp(baseline[j].name, name) == 0) {
+                base = &baseline[j];
+                break;
+            }
+        }
+        const bench_result* r = &results[i];
+        if(!base) {
+            fprintf(stderr, "%-40s %10s %10.2f %8s %12s %12.3f %8s  new\n", name, "-", r->fps, "", "-", r->frame_p99_ms, "");
+            continue;
+        }
+        //Positive deltas are always improvements: more frames/s, shorter p99 frame time
+        double fps_delta = (r->fps - base->fps) / base->fps * 100;
+        double p99_delta = base->frame_p99_ms > 0 ? (base->frame_p99_ms - r->frame_p99_ms) / base->frame_p99_ms * 100 : 0;
+        int regressed = fps_delta < -cfg->threshold || p99_delta < -cfg->threshold;
+        regressions += regressed;
+        fprintf(stderr, "%-40s %10.2f %10.2f %+7.1f%% %12.3f %12.3f %+7.1f%%  %s\n", name, base->fps, r->fps, fps_delta,
+            base->frame_p99_ms, r->frame_p99_ms, p99_delta, regressed ? "REGRESSION" : "ok");
+    }
+    fprintf(stderr, "%d regression(s) beyond %.1f%%\n", regressions, cfg->threshold);
+    return regressions;
+}
+
+/*
+    Command line
+*/
+
+void parse_list(value_list* list, char* arg) {
+    list->count = 0;
+    for(char* tok = strtok(arg, ","); tok && list->count < MAX_VALUES; tok = strtok(NULL, ",")) {
+        list->values[list->count++] = tok;
+    }
+}
+
+void set_default_list(value_list* list, const char* values) {
+    char* copy = malloc(strlen(values) + 1);
+    strcpy(copy, values);
+    parse_list(list, copy);
+}
+
+void usage() {
+    fprintf(stderr,
+        "usage: g2v_bench [options]\n"
+        "  --res LIST        resolutions: 720p,1080p,1440p,4k,8k (default 720p,1080p,4k)\n"
+        "  --scene LIST      scene cost: clear,fill,draws (default clear,fill,draws)\n"
+        "  --depth LIST      readback depth, 2..%d targets in flight (default 2,3)\n"
+        "  --convert LIST    conversion path: default,point,fast_bilinear,bilinear,bicubic (default default)\n"
+        "  --preset LIST     encoder presets (default ultrafast)\n"
+        "  --codec NAME      encoder (default libx264)\n"
+        "  --frames N        frames per combination (default 120)\n"
+        "  --format FMT      csv or json (default csv)\n"
+        "  --output FILE     report file (default stdout)\n"
+        "  --video FILE      encoded video, overwritten by every combination (default g2v_bench.mkv)\n"
+        "  --software        force Mesa llvmpipe, for machines without a GPU\n"
+        "  --baseline FILE   compare with a JSON report, exit with status 2 on regressions\n"
+        "  --threshold PCT   tolerated fps/p99 frame time regression in percent (default 5)\n",
+        G2V_MAX_TARGETS);
+    exit(1);
+}
+
+const resolution* find_resolution(const char* name) {
+    for(size_t i = 0; i < sizeof resolutions / sizeof *resolutions; i++) {
+        if(strcmp(resolutions[i].name, name) == 0) {
+            return &resolutions[i];
+        }
+    }
+    fprintf(stderr, "Unknown resolution: %s\n", name);
+    exit(1);
+}
+
+const conversion* find_conversion(const char* name) {
+    for(size_t i = 0; i < sizeof conversions / sizeof *conversions; i++) {
+        if(strcmp(conversions[i].name, name) == 0) {
+            return &conversions[i];
+        }
+    }
+    fprintf(stderr, "Unknown conversion path: %s\n", name);
+    exit(1);
+}
+
+void force_software_rendering() {
+#ifdef _WIN32
+    _putenv("LIBGL_ALWAYS_SOFTWARE=1");
+    _putenv("GALLIUM_DRIVER=llvmpipe");
+#else
+    setenv("LIBGL_ALWAYS_SOFTWARE", "1", 1);
+    setenv("GALLIUM_DRIVER", "llvmpipe", 1);
+#endif
+}
+
+int main(int argc, char** argv) {
+    bench_config cfg = { 0 };
+    set_default_list(&cfg.resolutions, "720p,1080p,4k");
+    set_default_list(&cfg.scenes, "clear,fill,draws");
+    set_default_list(&cfg.depths, "2,3");
+    set_default_list(&cfg.conversions, "default");
+    set_default_list(&cfg.presets, "ultrafast");
+    cfg.codec = "libx264";
+    cfg.output_file = "g2v_bench.mkv";
+    cfg.frames = 120;
+    cfg.fps = 60;
+    cfg.threshold = 5;
+
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if(strcmp(arg, "--software") == 0) {
+            force_software_rendering();
+            continue;
+        }
+        if(i + 1 >= argc) {
+            usage();
+        }
+        char* value = argv[++i];
+        if(strcmp(arg, "--res") == 0) parse_list(&cfg.resolutions, value);
+        else if(strcmp(arg, "--scene") == 0) parse_list(&cfg.scenes, value);
+        else if(strcmp(arg, "--depth") == 0) parse_list(&cfg.depths, value);
+        else if(strcmp(arg, "--convert") == 0) parse_list(&cfg.conversions, value);
+        else if(strcmp(arg, "--preset") == 0) parse_list(&cfg.presets, value);
+        else if(strcmp(arg, "--codec") == 0) cfg.codec = value;
+        else if(strcmp(arg, "--frames") == 0) cfg.frames = atoi(value);
+        else if(strcmp(arg, "--format") == 0) cfg.json = strcmp(value, "json") == 0;
+        else if(strcmp(arg, "--output") == 0) cfg.report_file = value;
+        else if(strcmp(arg, "--video") == 0) cfg.output_file = value;
+        else if(strcmp(arg, "--baseline") == 0) cfg.baseline_file = value;
+        else if(strcmp(arg, "--threshold") == 0) cfg.threshold = atof(value);
+        else usage();
+    }
+
+    FILE* report = cfg.report_file ? fopen(cfg.report_file, "w") : stdout;
+    if(!report) {
+        fprintf(stderr, "Could not open %s\n", cfg.report_file);
+        return 1;
+    }
+
+    CHECK(g2v_create_context())
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    fprintf(stderr, "Renderer: %s\n", renderer);
+
+    if(cfg.json) {
+        fprintf(report, "{\"renderer\":\"%s\",\"results\":[\n", renderer);
+    } else {
+        print_csv_header(report);
+    }
+
+    static bench_case cases[MAX_CASES];
+    static bench_result results[MAX_CASES];
+    int n = 0;
+    for(int a = 0; a < cfg.resolutions.count; a++)
+    for(int b = 0; b < cfg.scenes.count; b++)
+    for(int d = 0; d < cfg.depths.count; d++)
+    for(int e = 0; e < cfg.conversions.count; e++)
+    for(int p = 0; p < cfg.presets.count && n < MAX_CASES; p++) {
+        bench_case c = {
+            find_resolution(cfg.resolutions.values[a]),
+            cfg.scenes.values[b],
+            atoi(cfg.depths.values[d]),
+            find_conversion(cfg.conversions.values[e]),
+            cfg.presets.values[p],
+        };
+        fprintf(stderr, "[%d] %s %s depth=%d convert=%s preset=%s\n", n + 1, c.res->name, c.scene, c.depth, c.conv->name, c.preset);
+        bench_result r = run_case(&cfg, &c);
+        if(cfg.json) {
+            print_json_row(report, &c, &r, n == 0);
+        } else {
+            print_csv_row(report, &c, &r);
+        }
+        fflush(report);
+        cases[n] = c;
+        results[n] = r;
+        n++;
+    }
+
+    if(cfg.json) {
+        fprintf(report, "\n]}\n");
+    }
+    if(report != stdout) {
+        fclose(report);
+    }
+    g2v_free_context();
+
+    if(cfg.baseline_file && compare_with_baseline(&cfg, cases, results, n) > 0) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include "gl2vid.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+
+/*
+    flat_test: renders alternating single colour and two colour frames with detect_flat into a raw encoder.
+    Every single colour frame must take the flat fast path, and every frame must still be written with the pixels it was rendered with.
+*/
+
+#define CHECK(x) if(!(x)) { fprintf(stderr, "Error occurred: %s\n", g2v_get_error_log()); exit(1); }
+#define FAIL(...) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define WIDTH 64
+#define HEIGHT 48
+#define FRAMES 50
+
+typedef struct {
+    unsigned char r, g, b;
+} colour;
+
+//Odd frames are a single colour, even frames have a differently coloured bottom half
+void frame_colours(int frame, colour* top, colour* bottom) {
+    top->r = (unsigned char)(frame * 5);
+    top->g = (unsigned char)(255 - frame * 3);
+    top->b = 100;
+    *bottom = *top;
+    if(frame % 2 == 0) {
+        bottom->b = 220;
+    }
+}
+
+void clear(colour c) {
+    glClearColor(c.r / 255.0f, c.g / 255.0f, c.b / 255.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+int render_video_frame(g2v_render_ctx* ctx, void* userptr) {
+    int frame = ctx->current_frame_index;
+    if(frame >= FRAMES) {
+        return G2V_TRUE;
+    }
+    colour top, bottom;
+    frame_colours(frame, &top, &bottom);
+    clear(top);
+    if(frame % 2 == 0) {
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(0, 0, WIDTH, HEIGHT / 2);
+        clear(bottom);
+        glDisable(GL_SCISSOR_TEST);
+    }
+    return G2V_FALSE;
+}
+
+int pixel_is(const unsigned char* bgra, colour c) {
+    return bgra[0] == c.b && bgra[1] == c.g && bgra[2] == c.r;
+}
+
+int main() {
+    CHECK(g2v_create_context())
+
+    g2v_render_options opts;
+    g2v_render_default_options(&opts, WIDTH, HEIGHT);
+    opts.detect_flat = G2V_TRUE;
+    g2v_render_ctx rctx;
+    CHECK(g2v_init_render_ctx_ex(&rctx, &opts))
+
+    FILE* raw_file = tmpfile();
+    CHECK(raw_file)
+    g2v_encoder encoder;
+    CHECK(g2v_create_raw_encoder(&encoder, &rctx, raw_file))
+    encoder.render_video_frame = render_video_frame;
+    CHECK(g2v_encode(&encoder, &rctx))
+    CHECK(g2v_finish_raw_encoder(&encoder))
+
+    g2v_stats stats;
+    g2v_get_stats(&rctx, &stats);
+    if(stats.flat_frames != FRAMES / 2) {
+        FAIL("%d frames took the flat frame fast path, expected %d", stats.flat_frames, FRAMES / 2)
+    }
+
+    size_t frame_size = sizeof(int) * WIDTH * HEIGHT;
+    unsigned char* pixels = malloc(frame_size);
+    CHECK(pixels)
+    rewind(raw_file);
+    for(int i = 0; i < FRAMES; i++) {
+        if(fread(pixels, 1, frame_size, raw_file) != frame_size) {
+            FAIL("Raw encoder wrote %d frames instead of %d", i, FRAMES)
+        }
+        colour top, bottom;
+        frame_colours(i, &top, &bottom);
+        if(!pixel_is(pixels, top) || !pixel_is(pixels + frame_size - sizeof(int), bottom)) {
+            FAIL("Frame %d doesn't hold the pixels it was rendered with", i)
+        }
+    }
+    free(pixels);
+
+    fclose(raw_file);
+    g2v_free_render_ctx(&rctx);
+    g2v_free_context();
+
+    printf("%d/%d frames took the flat frame fast path\n", stats.flat_frames, FRAMES);
+    return 0;
+}
@@ -0,0 +1,356 @@
+#include "gl2vid.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include <threads.h>
+#include <time.h>
+#include "libswscale/swscale.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define HAVE_RDTSC
+#endif
+
+/*
+    g2v_microbench: isolates the CPU-side pixel kernels of gl2vid (no OpenGL context needed) and runs them on
+    synthetic frames of several sizes, with warm or cold caches and one or more threads.
+
+    Reports throughput in GB/s (bytes read + bytes written) and, on x86, TSC cycles per pixel.
+        ./g2v_microbench [--threads 1,4] [--iterations 50] [--format csv|json]
+*/
+
+#define MAX_THREADS 64
+#define EVICT_BYTES (256 << 20)
+
+typedef struct {
+    const char* name;
+    int width, height;
+} frame_size;
+
+const frame_size sizes[] = {
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+    { "4k", 3840, 2160 },
+    { "8k", 7680, 4320 },
+};
+
+/*
+    A minimal thread pool, so the multi-threaded runs don't measure thread creation
+*/
+
+typedef void (*band_fn)(void* job, int band, int bands);
+
+typedef struct {
+    thrd_t threads[MAX_THREADS];
+    int count;
+    mtx_t lock;
+    cnd_t start, done;
+    int generation, remaining, quit;
+    band_fn fn;
+    void* job;
+} thread_pool;
+
+typedef struct {
+    thread_pool* pool;
+    int index;
+} worker_arg;
+
+worker_arg worker_args[MAX_THREADS];
+
+int worker_main(void* arg) {
+    worker_arg* w = arg;
+    thread_pool* pool = w->pool;
+    int seen = 0;
+    for(;;) {
+        mtx_lock(&pool->lock);
+        while(pool->generation == seen && !pool->quit) {
+            cnd_wait(&pool->start, &pool->lock);
+        }
+        seen = pool->generation;
+        int quit = pool->quit;
+        mtx_unlock(&pool->lock);
+        if(quit) {
+            return 0;
+        }
+
+        pool->fn(pool->job, w->index, pool->count);
+
+        mtx_lock(&pool->lock);
+        if(--pool->remaining == 0) {
+            cnd_signal(&pool->done);
+        }
+        mtx_unlock(&pool->lock);
+    }
+}
+
+void pool_init(thread_pool* pool, int count) {
+    memset(pool, 0, sizeof *pool);
+    pool->count = count;
+    mtx_init(&pool->lock, mtx_plain);
+    cnd_init(&pool->start);
+    cnd_init(&pool->done);
+    for(int i = 0; i < count; i++) {
+        worker_args[i].pool = pool;
+        worker_args[i].index = i;
+        thrd_create(&pool->threads[i], worker_main, &worker_args[i]);
+    }
+}
+
+void pool_run(thread_pool* pool, band_fn fn, void* job) {
+    if(pool->count <= 1) {
+        fn(job, 0, 1);
+        return;
+    }
+    mtx_lock(&pool->lock);
+    pool->fn = fn;
+    pool->job = job;
+    pool->remaining = pool->count;
+    pool->generation++;
+    cnd_broadcast(&pool->start);
+    while(pool->remaining > 0) {
+        cnd_wait(&pool->done, &pool->lock);
+    }
+    mtx_unlock(&pool->lock);
+}
+
+void pool_free(thread_pool* pool) {
+    mtx_lock(&pool->lock);
+    pool->quit = 1;
+    cnd_broadcast(&pool->start);
+    mtx_unlock(&pool->lock);
+    for(int i = 0; i < pool->count; i++) {
+        thrd_join(pool->threads[i], NULL);
+    }
+    mtx_destroy(&pool->lock);
+    cnd_destroy(&pool->start);
+    cnd_destroy(&pool->done);
+}
+
+//Split height rows into bands, with even boundaries (for 4:2:0 chroma)
+void band_rows(int height, int band, int bands, int* y0, int* y1) {
+    *y0 = (int)((long long)height * band / bands) & ~1;
+    *y1 = band == bands - 1 ? height : (int)((long long)height * (band + 1) / bands) & ~1;
+}
+
+/*
+    Kernels
+*/
+
+typedef struct {
+    int width, height;
+    int* rgba;
+    int* flipped;
+    uint8_t* yuv[3];
+    int yuv_linesize[3];
+    struct SwsContext* sws[MAX_THREADS];
+    unsigned long long hashes[MAX_THREADS];
+} kernel_job;
+
+void flip_band(void* arg, int band, int bands) {
+    kernel_job* job = arg;
+    int y0, y1;
+    band_rows(job->height, band, bands, &y0, &y1);
+    //Rows [y0, y1) of the source end up in rows [height - y1, height - y0) of the destination
+    g2v_flip_rows(job->flipped + (size_t)(job->height - y1) * job->width, job->rgba + (size_t)y0 * job->width, job->width, y1 - y0);
+}
+
+void convert_band(void* arg, int band, int bands) {
+    kernel_job* job = arg;
+    int y0, y1;
+    band_rows(job->height, band, bands, &y0, &y1);
+    const uint8_t* src[1] = { (const uint8_t*)(job->rgba + (size_t)y0 * job->width) };
+    int src_linesize[1] = { 4 * job->width };
+    uint8_t* dst[3] = {
+        job->yuv[0] + (size_t)y0 * job->yuv_linesize[0],
+        job->yuv[1] + (size_t)(y0 / 2) * job->yuv_linesize[1],
+        job->yuv[2] + (size_t)(y0 / 2) * job->yuv_linesize[2],
+    };
+    //Every band is converted as an independent image, with its own context
+    sws_scale(job->sws[band], src, src_linesize, 0, y1 - y0, dst, job->yuv_linesize);
+}
+
+void hash_band(void* arg, int band, int bands) {
+    kernel_job* job = arg;
+    int y0, y1;
+    band_rows(job->height, band, bands, &y0, &y1);
+    job->hashes[band] = g2v_hash_frame(job->rgba + (size_t)y0 * job->width, sizeof(int) * job->width * (y1 - y0));
+}
+
+typedef struct {
+    const char* name;
+    band_fn fn;
+    //Bytes read + written per pixel
+    double bytes_per_pixel;
+} kernel;
+
+const kernel kernels[] = {
+    { "flip_rows", flip_band, 8 },
+    { "sws_rgb32_yuv420p", convert_band, 4 + 1.5 },
+    { "hash_frame", hash_band, 4 },
+};
+
+/*
+    Measurement
+*/
+
+unsigned char* evict_buffer;
+
+void evict_caches() {
+    //Writing a buffer much larger than the last level cache pushes the frame out of it
+    for(size_t i = 0; i < EVICT_BYTES; i += 64) {
+        evict_buffer[i]++;
+    }
+}
+
+//Plain C11 clock, so no OpenGL/GLFW initialization is needed
+double now() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+unsigned long long read_cycles() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+typedef struct {
+    double seconds_per_frame;
+    double gb_per_second;
+    double cycles_per_pixel;
+} kernel_result;
+
+kernel_result run_kernel(const kernel* k, kernel_job* job, thread_pool* pool, int cold, int iterations) {
+    double seconds = 0;
+    unsigned long long cycles = 0;
+
+    //One untimed run, so page faults of the first touch are never measured
+    pool_run(pool, k->fn, job);
+    for(int i = 0; i < iterations; i++) {
+        if(cold) {
+            evict_caches();
+        }
+        unsigned long long c0 = read_cycles();
+        double t0 = now();
+        pool_run(pool, k->fn, job);
+        seconds += now() - t0;
+        cycles += read_cycles() - c0;
+    }
+
+    double pixels = (double)job->width * job->height;
+    kernel_result r;
+    r.seconds_per_frame = seconds / iterations;
+    r.gb_per_second = pixels * k->bytes_per_pixel / r.seconds_per_frame * 1e-9;
+#ifdef HAVE_RDTSC
+    r.cycles_per_pixel = (double)cycles / iterations / pixels;
+#else
+    r.cycles_per_pixel = -1;
+#endif
+    return r;
+}
+
+void init_job(kernel_job* job, const frame_size* size, int threads) {
+    job->width = size->width;
+    job->height = size->height;
+    size_t pixels = (size_t)size->width * size->height;
+    job->rgba = malloc(pixels * 4);
+    job->flipped = malloc(pixels * 4);
+    //Synthetic content, so that the converter can't take shortcuts on a constant image
+    for(size_t i = 0; i < pixels; i++) {
+        job->rgba[i] = (int)(i * 2654435761u);
+    }
+    job->yuv_linesize[0] = size->width;
+    job->yuv_linesize[1] = job->yuv_linesize[2] = (size->width + 1) / 2;
+    job->yuv[0] = malloc(pixels);
+    job->yuv[1] = malloc(pixels / 4 + size->width);
+    job->yuv[2] = malloc(pixels / 4 + size->width);
+    for(int i = 0; i < threads; i++) {
+        int y0, y1;
+        band_rows(size->height, i, threads, &y0, &y1);
+        job->sws[i] = sws_getContext(size->width, y1 - y0, AV_PIX_FMT_RGB32, size->width, y1 - y0, AV_PIX_FMT_YUV420P, 0, NULL, NULL, NULL);
+    }
+}
+
+void free_job(kernel_job* job, int threads) {
+    free(job->rgba);
+    free(job->flipped);
+    for(int i = 0; i < 3; i++) {
+        free(job->yuv[i]);
+    }
+    for(int i = 0; i < threads; i++) {
+        sws_freeContext(job->sws[i]);
+    }
+}
+
+int main(int argc, char** argv) {
+    int thread_counts[MAX_THREADS] = { 1, 4 }, thread_count_n = 2;
+    int iterations = 50, json = 0;
+
+    for(int i = 1; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "--threads") == 0) {
+            thread_count_n = 0;
+            for(char* tok = strtok(argv[i + 1], ","); tok && thread_count_n < MAX_THREADS; tok = strtok(NULL, ",")) {
+                int n = atoi(tok);
+                thread_counts[thread_count_n++] = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+            }
+        } else if(strcmp(argv[i], "--iterations") == 0) {
+            iterations = atoi(argv[i + 1]);
+        } else if(strcmp(argv[i], "--format") == 0) {
+            json = strcmp(argv[i + 1], "json") == 0;
+        } else {
+            fprintf(stderr, "usage: g2v_microbench [--threads 1,4] [--iterations 50] [--format csv|json]\n");
+            return 1;
+        }
+    }
+    if(iterations < 1) {
+        iterations = 1;
+    }
+
+    evict_buffer = calloc(EVICT_BYTES, 1);
+
+    if(json) {
+        printf("[\n");
+    } else {
+        printf("kernel,size,cache,threads,iterations,ms_per_frame,gb_per_s,cycles_per_pixel\n");
+    }
+    int first = 1;
+    for(int t = 0; t < thread_count_n; t++) {
+        thread_pool pool;
+        pool_init(&pool, thread_counts[t]);
+        for(size_t s = 0; s < sizeof sizes / sizeof *sizes; s++) {
+            kernel_job job;
+            init_job(&job, &sizes[s], thread_counts[t]);
+            for(size_t k = 0; k < sizeof kernels / sizeof *kernels; k++) {
+                for(int cold = 0; cold <= 1; cold++) {
+                    kernel_result r = run_kernel(&kernels[k], &job, &pool, cold, iterations);
+                    if(json) {
+                        printf("%s{\"kernel\":\"%s\",\"size\":\"%s\",\"cache\":\"%s\",\"threads\":%d,\"iterations\":%d,\"ms_per_frame\":%.4f,\"gb_per_s\":%.3f,\"cycles_per_pixel\":%.3f}",
+                            first ? "" : ",\n", kernels[k].name, sizes[s].name, cold ? "cold" : "warm", thread_counts[t], iterations,
+                            r.seconds_per_frame * 1e3, r.gb_per_second, r.cycles_per_pixel);
+                    } else {
+                        printf("%s,%s,%s,%d,%d,%.4f,%.3f,%.3f\n", kernels[k].name, sizes[s].name, cold ? "cold" : "warm", thread_counts[t], iterations,
+                            r.seconds_per_frame * 1e3, r.gb_per_second, r.cycles_per_pixel);
+                    }
+                    fflush(stdout);
+                    first = 0;
+                }
+            }
+            free_job(&job, thread_counts[t]);
+        }
+        pool_free(&pool);
+    }
+    if(json) {
+        printf("\n]\n");
+    }
+
+    free(evict_buffer);
+    return 0;
+}
@@ -0,0 +1,174 @@
+#include "gl2vid.h"
+
+#include "stdlib.h"
+#include "stdio.h"
+#include <threads.h>
+
+/*
+    tee_test: drives a raw sink and two hash sinks through a tee encoder, with flat and duplicate frames.
+    The raw sink gets every frame, its pixels are checked against what was rendered and its hashes against the first hash sink.
+    The second hash sink is slow and drops frames when its queue is full, every hash it writes must still match its frame.
+*/
+
+#define CHECK(x) if(!(x)) { fprintf(stderr, "Error occurred: %s\n", g2v_get_error_log()); exit(1); }
+#define FAIL(...) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define WIDTH 64
+#define HEIGHT 48
+#define FRAMES 100
+//Frames are rendered in cycles of 5: two colours, marked unchanged, flat, the same flat colour again, marked unchanged
+#define CYCLE 5
+#define SLOW_SINK_MS 20
+
+typedef struct {
+    unsigned char r, g, b;
+} colour;
+
+//Colours of the top and bottom halves of a frame
+void frame_colours(int frame, colour* top, colour* bottom) {
+    int base = frame - frame % CYCLE;
+    top->r = (unsigned char)(base * 37);
+    top->g = (unsigned char)(255 - base);
+    top->b = 200;
+    *bottom = *top;
+    if(frame % CYCLE < 2) {
+        bottom->b = 20;
+    }
+}
+
+void clear(colour c) {
+    glClearColor(c.r / 255.0f, c.g / 255.0f, c.b / 255.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+void render_frame(g2v_encoder* encoder, g2v_render_ctx* rctx) {
+    int frame = rctx->current_frame_index;
+    CHECK(g2v_begin_frame(encoder, rctx))
+    colour top, bottom;
+    frame_colours(frame, &top, &bottom);
+    switch(frame % CYCLE) {
+    case 0:
+        clear(top);
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(0, 0, WIDTH, HEIGHT / 2);
+        clear(bottom);
+        glDisable(GL_SCISSOR_TEST);
+        break;
+    case 2:
+    case 3:
+        clear(top);
+        break;
+    default:
+        g2v_mark_frame_unchanged(rctx);
+        break;
+    }
+    CHECK(g2v_submit_frame(encoder, rctx))
+    CHECK(g2v_poll(encoder, rctx) >= 0)
+}
+
+int (*write_hash)(g2v_render_ctx*, g2v_encoder*);
+
+//Keeps the queue of the slow sink full, so that the tee drops frames for it
+int slow_write_frame(g2v_render_ctx* ctx, g2v_encoder* encoder) {
+    thrd_sleep(&(struct timespec){ .tv_nsec = SLOW_SINK_MS * 1000000L }, NULL);
+    return write_hash(ctx, encoder);
+}
+
+int pixel_is(const unsigned char* bgra, colour c) {
+    return bgra[0] == c.b && bgra[1] == c.g && bgra[2] == c.r;
+}
+
+int main() {
+    CHECK(g2v_create_context())
+
+    g2v_render_options opts;
+    g2v_render_default_options(&opts, WIDTH, HEIGHT);
+    opts.detect_flat = G2V_TRUE;
+    opts.detect_duplicates = G2V_TRUE;
+    g2v_render_ctx rctx;
+    CHECK(g2v_init_render_ctx_ex(&rctx, &opts))
+
+    FILE* raw_file = tmpfile();
+    FILE* hash_file = tmpfile();
+    FILE* slow_file = tmpfile();
+    CHECK(raw_file && hash_file && slow_file)
+    g2v_encoder raw, hash, slow, tee;
+    CHECK(g2v_create_raw_encoder(&raw, &rctx, raw_file))
+    CHECK(g2v_create_hash_encoder(&hash, &rctx, hash_file))
+    CHECK(g2v_create_hash_encoder(&slow, &rctx, slow_file))
+    write_hash = slow.write_frame_fn;
+    slow.write_frame_fn = slow_write_frame;
+
+    g2v_tee_sink sinks[3] = {
+        { .encoder = &raw },
+        { .encoder = &hash },
+        { .encoder = &slow, .queue_frames = 1, .drop_when_full = G2V_TRUE },
+    };
+    CHECK(g2v_create_tee_encoder(&tee, &rctx, sinks, 3, NULL))
+
+    for(int i = 0; i < FRAMES; i++) {
+        render_frame(&tee, &rctx);
+    }
+    CHECK(g2v_end_frames(&tee, &rctx))
+    CHECK(g2v_finish_tee_encoder(&tee))
+    CHECK(g2v_finish_raw_encoder(&raw))
+    CHECK(g2v_finish_hash_encoder(&hash))
+    CHECK(g2v_finish_hash_encoder(&slow))
+
+    g2v_stats stats;
+    g2v_get_stats(&rctx, &stats);
+    if(stats.flat_frames == 0 || stats.duplicate_frames == 0) {
+        FAIL("Expected flat and duplicate frames, got %d flat and %d duplicates", stats.flat_frames, stats.duplicate_frames)
+    }
+
+    //Every frame reaches the raw sink, with the pixels it was rendered with
+    static unsigned long long hashes[FRAMES];
+    size_t frame_size = sizeof(int) * WIDTH * HEIGHT;
+    unsigned char* pixels = malloc(frame_size);
+    CHECK(pixels)
+    rewind(raw_file);
+    for(int i = 0; i < FRAMES; i++) {
+        if(fread(pixels, 1, frame_size, raw_file) != frame_size) {
+            FAIL("Raw sink wrote %d frames instead of %d", i, FRAMES)
+        }
+        colour top, bottom;
+        frame_colours(i, &top, &bottom);
+        if(!pixel_is(pixels, top) || !pixel_is(pixels + frame_size - sizeof(int), bottom)) {
+            FAIL("Raw frame %d doesn't hold the pixels it was rendered with", i)
+        }
+        hashes[i] = g2v_hash_frame(pixels, frame_size);
+    }
+    free(pixels);
+
+    rewind(hash_file);
+    for(int i = 0; i < FRAMES; i++) {
+        int index;
+        unsigned long long value;
+        if(fscanf(hash_file, "%d %llx", &index, &value) != 2 || index != i || value != hashes[i]) {
+            FAIL("Hash sink line %d doesn't match raw frame %d", i, i)
+        }
+    }
+
+    //The slow sink skips frames, but the ones it writes are in order and hashed from their own pixels
+    rewind(slow_file);
+    int written = 0, last = -1, index;
+    unsigned long long value;
+    while(fscanf(slow_file, "%d %llx", &index, &value) == 2) {
+        if(index <= last || index >= FRAMES || value != hashes[index]) {
+            FAIL("Slow sink hash of frame %d doesn't match the raw frame", index)
+        }
+        last = index;
+        written++;
+    }
+    if(written == 0 || written == FRAMES) {
+        FAIL("Slow sink wrote %d of %d frames, expected it to drop some", written, FRAMES)
+    }
+
+    fclose(raw_file);
+    fclose(hash_file);
+    fclose(slow_file);
+    g2v_free_render_ctx(&rctx);
+    g2v_free_context();
+
+    printf("Slow sink wrote %d of %d frames, %d flat and %d duplicate frames\n", written, FRAMES, stats.flat_frames, stats.duplicate_frames);
+    return 0;
+}
@@ -29,6 +29,13 @@ int main() {
     CHECK(g2v_encode(&encoder, &rctx))
     CHECK(g2v_finish_ffmpeg_encoder(&encoder))
 
+    g2v_stats stats;
+    g2v_get_stats(&rctx, &stats);
+    for(int i = 0; i < G2V_STAGE_COUNT; i++) {
+        g2v_stage_stats* s = &stats.stages[i];
+        printf("%-10s p50 %8.3fms  p95 %8.3fms  p99 %8.3fms  max %8.3fms\n", g2v_stage_name(i), s->p50 * 1e3, s->p95 * 1e3, s->p99 * 1e3, s->max * 1e3);
+    }
+
     g2v_free_render_ctx(&rctx);
     g2v_free_context(ctx);
 